@@ -0,0 +1,139 @@
+/*! @file bits.hpp
+    @brief Fixed- and dynamic-width bit-sets
+*/
+#pragma once
+#ifndef LIKELIGRID_BITS_HPP_
+#define LIKELIGRID_BITS_HPP_
+
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+namespace likeligrid {
+
+namespace detail {
+
+template <size_t N> class BitsStorage {
+  public:
+    explicit BitsStorage(size_t size) {
+        if (size > N) throw std::length_error("Bits<N>: size > N");
+    }
+    uint64_t* data() {return words_.data();}
+    const uint64_t* data() const {return words_.data();}
+    static constexpr size_t num_words() {return N / 64u;}
+  private:
+    std::array<uint64_t, N / 64u> words_ = {};
+};
+
+template <> class BitsStorage<0u> {
+  public:
+    explicit BitsStorage(size_t size): words_((size + 63u) / 64u, 0u) {}
+    uint64_t* data() {return words_.data();}
+    const uint64_t* data() const {return words_.data();}
+    size_t num_words() const {return words_.size();}
+  private:
+    std::vector<uint64_t> words_;
+};
+
+} // namespace detail
+
+/*! @brief Bit-set of N bits in 64-bit words; N = 0 for dynamic width
+
+    Counting and iteration use popcount and count-trailing-zeros,
+    and set operations work on whole words.
+    Dynamic-width operands must be constructed with the same size.
+*/
+template <size_t N>
+class Bits {
+    static_assert(N % 64u == 0u, "N must be a multiple of 64");
+  public:
+    explicit Bits(size_t size=N): storage_(size) {}
+
+    //! Construct from a string of '0' and '1'; the last character is bit 0
+    Bits(const std::string& str, size_t size): storage_(size) {
+        if (str.size() > size) throw std::length_error("Bits: string is too long");
+        for (size_t i=0u; i<str.size(); ++i) {
+            if (str[str.size() - 1u - i] == '1') set(i);
+        }
+    }
+
+    bool operator[](size_t i) const {
+        return (storage_.data()[i / 64u] >> (i % 64u)) & 1u;
+    }
+    Bits& set(size_t i) {
+        storage_.data()[i / 64u] |= uint64_t(1u) << (i % 64u);
+        return *this;
+    }
+    size_t count() const {
+        size_t n = 0u;
+        for (size_t w=0u; w<num_words(); ++w) {
+            n += static_cast<size_t>(__builtin_popcountll(storage_.data()[w]));
+        }
+        return n;
+    }
+    bool none() const {
+        for (size_t w=0u; w<num_words(); ++w) {
+            if (storage_.data()[w]) return false;
+        }
+        return true;
+    }
+    //! (*this & ~other) == 0
+    bool is_subset_of(const Bits& other) const {
+        for (size_t w=0u; w<num_words(); ++w) {
+            if (storage_.data()[w] & ~other.storage_.data()[w]) return false;
+        }
+        return true;
+    }
+    //! Call fn(i) for each set bit in ascending order
+    template <class Function>
+    void for_each(Function&& fn) const {
+        for (size_t w=0u; w<num_words(); ++w) {
+            for (uint64_t word = storage_.data()[w]; word; word &= word - 1u) {
+                fn(w * 64u + static_cast<size_t>(__builtin_ctzll(word)));
+            }
+        }
+    }
+    std::vector<size_t> indices() const {
+        std::vector<size_t> v;
+        v.reserve(count());
+        for_each([&v](size_t i) {v.push_back(i);});
+        return v;
+    }
+
+    Bits& operator|=(const Bits& other) {
+        for (size_t w=0u; w<num_words(); ++w) {
+            storage_.data()[w] |= other.storage_.data()[w];
+        }
+        return *this;
+    }
+    Bits operator|(const Bits& other) const {
+        return Bits(*this) |= other;
+    }
+    bool operator==(const Bits& other) const {
+        for (size_t w=0u; w<num_words(); ++w) {
+            if (storage_.data()[w] != other.storage_.data()[w]) return false;
+        }
+        return true;
+    }
+    bool operator!=(const Bits& other) const {return !(*this == other);}
+    bool operator<(const Bits& other) const {
+        for (size_t w=num_words(); w-- > 0u;) {
+            if (storage_.data()[w] != other.storage_.data()[w]) {
+                return storage_.data()[w] < other.storage_.data()[w];
+            }
+        }
+        return false;
+    }
+
+    size_t num_words() const {return storage_.num_words();}
+    const uint64_t* data() const {return storage_.data();}
+
+  private:
+    detail::BitsStorage<N> storage_;
+};
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_BITS_HPP_
@@ -0,0 +1,209 @@
+/*! @file cache.cpp
+    @brief Implementation of LoglikCache class
+*/
+#include "cache.hpp"
+
+#include <wtl/debug.hpp>
+#include <wtl/filesystem.hpp>
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+
+namespace likeligrid {
+
+namespace fs = wtl::filesystem;
+
+namespace {
+
+constexpr char magic[8] = {'L', 'G', 'R', 'I', 'D', 'C', 'C', 'H'};
+constexpr uint32_t version = 2u;
+constexpr size_t header_size = sizeof(magic) + 2u * sizeof(uint32_t);
+
+inline uint32_t checksum(const char* data, const size_t size) {
+    return static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0u),
+        reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size)));
+}
+
+//! flock() held until the end of the scope
+class FileLock {
+  public:
+    FileLock(const int fd, const std::string& path): fd_(fd) {
+        while (::flock(fd_, LOCK_EX) != 0) {
+            if (errno != EINTR) throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+    ~FileLock() {::flock(fd_, LOCK_UN);}
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+  private:
+    const int fd_;
+};
+
+//! Read from `offset` to the end of the file
+inline std::string read_from(const int fd, const size_t offset, const std::string& path) {
+    std::string content;
+    char buffer[1u << 16u];
+    for (ssize_t n = 0; (n = ::pread(fd, buffer, sizeof(buffer), static_cast<off_t>(offset + content.size()))) != 0;) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        content.append(buffer, static_cast<size_t>(n));
+    }
+    return content;
+}
+
+/*! @brief Append bytes in one write() under the lock
+
+    The file is truncated back to `end` if the write fails or is short,
+    so that no partial record is left for the next writer.
+*/
+inline void write_once(const int fd, const std::string& bytes, const size_t end, const std::string& path) {
+    ssize_t n = 0;
+    do {
+        n = ::write(fd, bytes.data(), bytes.size());
+    } while (n < 0 && errno == EINTR);
+    if (n >= 0 && static_cast<size_t>(n) == bytes.size()) return;
+    const int error = errno;
+    if (n > 0 && ::ftruncate(fd, static_cast<off_t>(end)) != 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    if (n < 0) {
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    throw std::runtime_error("short write to " + path);
+}
+
+} // namespace
+
+LoglikCache::LoglikCache(const std::string& dir, const std::string& fingerprint, const size_t num_params)
+: num_params_(num_params), table_(num_params), key_(num_params) {HERE;
+    fs::create_directories(dir);
+    path_ = (fs::path(dir) / (fingerprint + ".cache")).string();
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(), path_);
+    }
+    try {
+        // the first of the processes opening an empty file writes the header
+        FileLock lock(fd_, path_);
+        const std::string content = read_from(fd_, 0u, path_);
+        if (content.empty()) {
+            std::string header(magic, sizeof(magic));
+            const uint32_t n = static_cast<uint32_t>(num_params_);
+            header.append(reinterpret_cast<const char*>(&version), sizeof(version));
+            header.append(reinterpret_cast<const char*>(&n), sizeof(n));
+            write_once(fd_, header, 0u, path_);
+            end_ = header_size;
+            return;
+        }
+        uint32_t file_version = 0u, file_params = 0u;
+        if (content.size() >= header_size) {
+            std::memcpy(&file_version, content.data() + sizeof(magic), sizeof(uint32_t));
+            std::memcpy(&file_params, content.data() + sizeof(magic) + sizeof(uint32_t), sizeof(uint32_t));
+        }
+        if (content.size() < header_size || content.compare(0u, sizeof(magic), magic, sizeof(magic)) != 0
+            || file_version != version || file_params != num_params_) {
+            throw std::runtime_error("incompatible cache file: " + path_);
+        }
+        end_ = header_size + read_records(content.data() + header_size, content.size() - header_size);
+    } catch (...) {
+        ::close(fd_);
+        throw;
+    }
+    std::cerr << "cache: " << table_.size() << " records in " << path_ << std::endl;
+}
+
+// A record whose checksum does not match is skipped byte by byte
+// until the next intact record, e.g., after a partial record left by a crash.
+size_t LoglikCache::read_records(const char* data, const size_t size) {
+    const size_t key_size = num_params_ * sizeof(int16_t);
+    const size_t crc_pos = key_size + sizeof(double);
+    const size_t record_size = crc_pos + sizeof(uint32_t);
+    size_t intact_end = 0u;
+    size_t skipped = 0u;
+    for (size_t pos=0u; pos + record_size <= size;) {
+        const char* record = data + pos;
+        uint32_t crc;
+        std::memcpy(&crc, record + crc_pos, sizeof(crc));
+        if (crc != checksum(record, crc_pos)) {
+            ++pos;
+            ++skipped;
+            continue;
+        }
+        double loglik;
+        std::memcpy(key_.data(), record, key_size);
+        std::memcpy(&loglik, record + key_size, sizeof(double));
+        table_.emplace(key_.data(), loglik);
+        pos += record_size;
+        intact_end = pos;
+    }
+    if (skipped > 0u) {
+        std::cerr << "cache: skipped " << skipped << " corrupted bytes in " << path_ << std::endl;
+    }
+    return intact_end;
+}
+
+LoglikCache::~LoglikCache() {
+    try {
+        flush();
+    } catch (...) {}
+    ::close(fd_);
+}
+
+bool LoglikCache::encode(const std::valarray<double>& theta) {
+    return theta.size() == num_params_ && encode_lattice(theta, key_.data());
+}
+
+bool LoglikCache::find(const std::valarray<double>& theta, double* loglik) {
+    if (!encode(theta)) return false;
+    const size_t row = table_.find(key_.data());
+    if (row == LatticeTable::npos) return false;
+    *loglik = table_.loglik(row);
+    ++hits_;
+    return true;
+}
+
+void LoglikCache::insert(const std::valarray<double>& theta, const double loglik) {
+    if (!encode(theta)) return;
+    if (table_.emplace(key_.data(), loglik).second) {
+        const size_t begin = pending_.size();
+        pending_.append(reinterpret_cast<const char*>(key_.data()), key_.size() * sizeof(int16_t));
+        pending_.append(reinterpret_cast<const char*>(&loglik), sizeof(loglik));
+        const uint32_t crc = checksum(pending_.data() + begin, pending_.size() - begin);
+        pending_.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    }
+}
+
+// Records appended by other processes since the last read are loaded,
+// and a partial record at the end is truncated before appending.
+void LoglikCache::flush() {
+    if (pending_.empty()) return;
+    FileLock lock(fd_, path_);
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+        throw std::system_error(errno, std::generic_category(), path_);
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    if (size > end_) {
+        const std::string appended = read_from(fd_, end_, path_);
+        end_ += read_records(appended.data(), appended.size());
+        if (end_ < size && ::ftruncate(fd_, static_cast<off_t>(end_)) != 0) {
+            throw std::system_error(errno, std::generic_category(), path_);
+        }
+    }
+    write_once(fd_, pending_, end_, path_);
+    end_ += pending_.size();
+    pending_.clear();
+}
+
+} // namespace likeligrid
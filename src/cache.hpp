@@ -0,0 +1,70 @@
+/*! @file cache.hpp
+    @brief Interface of LoglikCache class
+*/
+#pragma once
+#ifndef LIKELIGRID_CACHE_HPP_
+#define LIKELIGRID_CACHE_HPP_
+
+#include "lattice.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <valarray>
+
+namespace likeligrid {
+
+/*! @brief Persistent loglik of parameters on the 0.01 lattice
+
+    A directory holds one append-only file per GenotypeModel::fingerprint():
+    magic "LGRIDCCH", uint32 version, uint32 number of parameters,
+    followed by records of int16 lattice coordinates, a double loglik,
+    and uint32 crc32 of them.
+    Processes sharing the directory take flock() to create the header
+    and to append records with a single O_APPEND write() per flush.
+    Before appending, the records added by others are loaded
+    and a partial record left by a crash or a short write is truncated.
+    Records failing the checksum are skipped on reading.
+    O_APPEND is not atomic on NFS, so do not share the directory across hosts there.
+
+    Not thread-safe; use it from the thread scheduling evaluations.
+*/
+class LoglikCache {
+  public:
+    LoglikCache(const std::string& dir, const std::string& fingerprint, size_t num_params);
+    ~LoglikCache();
+    LoglikCache(const LoglikCache&) = delete;
+    LoglikCache& operator=(const LoglikCache&) = delete;
+
+    //! Set loglik and return true if theta is cached
+    bool find(const std::valarray<double>& theta, double* loglik);
+    //! theta off the lattice is ignored
+    void insert(const std::valarray<double>& theta, double loglik);
+    //! Append new records to the file and load those of other processes
+    void flush();
+
+    const std::string& path() const {return path_;}
+    size_t size() const {return table_.size();}
+    size_t hits() const {return hits_;}
+
+  private:
+    //! Encode theta into key_; false if theta is off the lattice
+    bool encode(const std::valarray<double>& theta);
+    //! Load intact records; return the end of the last one
+    size_t read_records(const char* data, size_t size);
+
+    std::string path_;
+    const size_t num_params_;
+    int fd_ = -1;
+    //! end of the records read or written by this process
+    size_t end_ = 0u;
+    LatticeTable table_;
+    std::vector<int16_t> key_;
+    //! records not yet written
+    std::string pending_;
+    size_t hits_ = 0u;
+};
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_CACHE_HPP_
@@ -0,0 +1,407 @@
+/*! @file columnar.cpp
+    @brief Implementation of binary columnar result files
+*/
+#include "columnar.hpp"
+#include "util.hpp"
+
+#include <wtl/iostr.hpp>
+#include <wtl/numeric.hpp>
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+
+namespace likeligrid {
+
+namespace {
+
+template <class T> inline void write_pod(std::ostream& ost, const T& x) {
+    ost.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+template <class T> inline void append_pod(std::string* buffer, const T& x) {
+    buffer->append(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+template <class T> inline T read_pod(const char* ptr) {
+    T x;
+    std::memcpy(&x, ptr, sizeof(T));
+    return x;
+}
+
+constexpr size_t file_header_size = sizeof(columnar::magic) + 2u * sizeof(uint32_t) + 2u * sizeof(uint64_t);
+constexpr size_t block_header_size = 2u * sizeof(uint64_t);
+
+//! Keep payloads and footers aligned for doubles
+inline size_t padded_size(const size_t n) {
+    return (n + sizeof(double) - 1u) / sizeof(double) * sizeof(double);
+}
+
+inline size_t footer_size(const size_t num_columns) {
+    return sizeof(columnar::checkpoint_magic) + 2u * sizeof(uint64_t)
+           + num_columns * sizeof(double) + 2u * sizeof(uint32_t);
+}
+
+inline uint32_t checksum(const char* data, const size_t size) {
+    return static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0u),
+        reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size)));
+}
+
+//! Map a whole file; nullptr for an empty file
+inline const char* map_file(const std::string& path, size_t* size) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::ios_base::failure("cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::ios_base::failure("cannot stat " + path);
+    }
+    *size = static_cast<size_t>(st.st_size);
+    if (*size == 0u) {
+        ::close(fd);
+        return nullptr;
+    }
+    void* addr = ::mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::ios_base::failure("cannot mmap " + path);
+    }
+    return static_cast<const char*>(addr);
+}
+
+inline void unmap_file(const char* map, const size_t size) {
+    if (map) ::munmap(const_cast<char*>(map), size);
+}
+
+/*! @brief Fill header, num_columns, and compressed; return the offset of the first block
+
+    Return 0 if the file ends within the file header,
+    e.g., if it was killed before the header was written.
+*/
+inline size_t read_file_header(const char* map, const size_t size, const std::string& path,
+                               ColumnarCheckpoint* checkpoint) {
+    if (size > 0u && std::memcmp(map, columnar::magic, std::min(size, sizeof(columnar::magic))) != 0) {
+        throw std::runtime_error("not a binary result file: " + path);
+    }
+    if (size < file_header_size) return 0u;
+    size_t offset = sizeof(columnar::magic);
+    const auto version = read_pod<uint32_t>(map + offset);
+    offset += sizeof(uint32_t);
+    const auto flags = read_pod<uint32_t>(map + offset);
+    offset += sizeof(uint32_t);
+    const auto num_columns = read_pod<uint64_t>(map + offset);
+    offset += sizeof(uint64_t);
+    const auto header_size = read_pod<uint64_t>(map + offset);
+    offset += sizeof(uint64_t);
+    if (version != columnar::version || num_columns == 0u) {
+        throw std::runtime_error("unsupported binary result file: " + path);
+    }
+    if (offset + padded_size(header_size) > size) return 0u;
+    checkpoint->num_columns = num_columns;
+    checkpoint->compressed = (flags & columnar::zlib_flag);
+    checkpoint->header.assign(map + offset, header_size);
+    checkpoint->approximate = has_approximate_column(checkpoint->header);
+    offset += padded_size(header_size);
+    checkpoint->valid_size = offset;
+    return offset;
+}
+
+/*! @brief Validate the footer at `pos` and its block, then update `checkpoint`
+
+    The block has to begin at or after `data_begin`.
+*/
+inline bool read_footer(const char* map, const size_t size, const size_t pos,
+                        const size_t data_begin, ColumnarCheckpoint* checkpoint) {
+    const size_t num_columns = checkpoint->num_columns;
+    const size_t footer_bytes = footer_size(num_columns);
+    if (pos + footer_bytes > size) return false;
+    const char* footer = map + pos;
+    if (std::memcmp(footer, columnar::checkpoint_magic, sizeof(columnar::checkpoint_magic)) != 0) {
+        return false;
+    }
+    const size_t crc_pos = footer_bytes - 2u * sizeof(uint32_t);
+    const size_t self_crc_pos = crc_pos + sizeof(uint32_t);
+    if (read_pod<uint32_t>(footer + self_crc_pos) != checksum(footer, self_crc_pos)) {
+        return false;
+    }
+    size_t offset = sizeof(columnar::checkpoint_magic);
+    const auto block_offset = read_pod<uint64_t>(footer + offset);
+    offset += sizeof(uint64_t);
+    if (block_offset < data_begin || block_offset + block_header_size > pos) return false;
+    const auto stored_size = read_pod<uint64_t>(map + block_offset + sizeof(uint64_t));
+    if (block_offset + block_header_size + padded_size(stored_size) != pos) return false;
+    const char* payload = map + block_offset + block_header_size;
+    if (read_pod<uint32_t>(footer + crc_pos) != checksum(payload, stored_size)) return false;
+    checkpoint->num_rows = read_pod<uint64_t>(footer + offset);
+    offset += sizeof(uint64_t);
+    checkpoint->max_loglik = read_pod<double>(footer + offset);
+    offset += sizeof(double);
+    if (checkpoint->max_loglik == std::numeric_limits<double>::lowest()) {
+        checkpoint->mle_params.resize(0u);
+    } else {
+        const size_t num_params = num_columns - (checkpoint->approximate ? 2u : 1u);
+        checkpoint->mle_params.resize(num_params);
+        std::memcpy(&checkpoint->mle_params[0u], footer + offset, num_params * sizeof(double));
+    }
+    checkpoint->valid_size = pos + footer_bytes;
+    return true;
+}
+
+} // namespace
+
+ColumnarWriter::ColumnarWriter(const std::string& path, const std::string& header,
+                               const size_t num_columns, const bool compress)
+: num_columns_(num_columns), compress_(compress), columns_(num_columns) {
+    if (is_columnar(path)) {
+        checkpoint_ = read_checkpoint(path);
+    }
+    if (checkpoint_.valid_size > 0u) {
+        if (checkpoint_.num_columns != num_columns) {
+            throw std::runtime_error("number of columns mismatch: " + path);
+        }
+        compress_ = checkpoint_.compressed;
+        // discard an incomplete block
+        if (::truncate(path.c_str(), static_cast<off_t>(checkpoint_.valid_size)) != 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        ofs_.open(path, std::ios::binary | std::ios::app);
+    } else {
+        ofs_.open(path, std::ios::binary | std::ios::trunc);
+    }
+    ofs_.exceptions(std::ios::failbit | std::ios::badbit);
+    if (checkpoint_.valid_size == 0u) {
+        ofs_.write(columnar::magic, sizeof(columnar::magic));
+        write_pod(ofs_, columnar::version);
+        write_pod(ofs_, compress_ ? columnar::zlib_flag : uint32_t(0u));
+        write_pod(ofs_, static_cast<uint64_t>(num_columns_));
+        write_pod(ofs_, static_cast<uint64_t>(header.size()));
+        ofs_ << header;
+        ofs_ << std::string(padded_size(header.size()) - header.size(), '\0');
+        checkpoint_.header = header;
+        checkpoint_.num_columns = num_columns_;
+        checkpoint_.compressed = compress_;
+        checkpoint_.approximate = has_approximate_column(header);
+        checkpoint_.valid_size = file_header_size + padded_size(header.size());
+        // a file killed before the first block is resumed from the header
+        ofs_.flush();
+    }
+    for (auto& column: columns_) {
+        column.reserve(block_rows_);
+    }
+}
+
+ColumnarWriter::~ColumnarWriter() {
+    try {
+        flush();
+    } catch (...) {}
+}
+
+void ColumnarWriter::push_back(const double loglik, const std::valarray<double>& params) {
+    columns_[0u].push_back(loglik);
+    for (size_t j=1u; j<num_columns_; ++j) {
+        columns_[j].push_back(params[j - 1u]);
+    }
+    // approximate rows are not candidates of MLE
+    if (!checkpoint_.approximate) {
+        compete(loglik, params);
+    } else if (params[num_columns_ - 2u] == 0.0) {
+        compete(loglik, params[std::slice(0u, num_columns_ - 2u, 1u)]);
+    }
+    if (columns_[0u].size() >= block_rows_) {flush();}
+}
+
+// same rule as read_body()
+void ColumnarWriter::compete(const double loglik, const std::valarray<double>& params) {
+    if (wtl::approx(loglik, checkpoint_.max_loglik)) {
+        if (d2_from_neutral(params) < d2_from_neutral(checkpoint_.mle_params)) {
+            checkpoint_.max_loglik = loglik;
+            checkpoint_.mle_params = params;
+        }
+    } else if (loglik > checkpoint_.max_loglik) {
+        checkpoint_.max_loglik = loglik;
+        checkpoint_.mle_params = params;
+    }
+}
+
+void ColumnarWriter::flush() {
+    const size_t num_rows = columns_[0u].size();
+    if (num_rows == 0u) return;
+    std::vector<double> payload;
+    payload.reserve(num_rows * num_columns_);
+    for (auto& column: columns_) {
+        payload.insert(payload.end(), column.begin(), column.end());
+        column.clear();
+    }
+    const auto* bytes = reinterpret_cast<const Bytef*>(payload.data());
+    uLong stored_size = static_cast<uLong>(payload.size() * sizeof(double));
+    std::vector<Bytef> compressed;
+    if (compress_) {
+        uLongf dest_size = compressBound(stored_size);
+        compressed.resize(dest_size);
+        if (compress2(compressed.data(), &dest_size, bytes, stored_size, Z_BEST_SPEED) != Z_OK) {
+            throw std::runtime_error("zlib compress2() failed");
+        }
+        bytes = compressed.data();
+        stored_size = dest_size;
+    }
+    const char* stored = reinterpret_cast<const char*>(bytes);
+    const size_t block_offset = checkpoint_.valid_size;
+    checkpoint_.num_rows += num_rows;
+    std::string footer(columnar::checkpoint_magic, sizeof(columnar::checkpoint_magic));
+    footer.reserve(footer_size(num_columns_));
+    append_pod(&footer, static_cast<uint64_t>(block_offset));
+    append_pod(&footer, static_cast<uint64_t>(checkpoint_.num_rows));
+    append_pod(&footer, checkpoint_.max_loglik);
+    for (size_t j=1u; j<num_columns_; ++j) {
+        const double x = checkpoint_.mle_params.size() < j ? 0.0 : checkpoint_.mle_params[j - 1u];
+        append_pod(&footer, x);
+    }
+    append_pod(&footer, checksum(stored, stored_size));
+    append_pod(&footer, checksum(footer.data(), footer.size()));
+    write_pod(ofs_, static_cast<uint64_t>(num_rows));
+    write_pod(ofs_, static_cast<uint64_t>(stored_size));
+    ofs_.write(stored, static_cast<std::streamsize>(stored_size));
+    ofs_ << std::string(padded_size(stored_size) - stored_size, '\0');
+    ofs_ << footer;
+    ofs_.flush();
+    checkpoint_.valid_size += block_header_size + padded_size(stored_size) + footer.size();
+}
+
+ColumnarReader::ColumnarReader(const std::string& path) {
+    map_ = map_file(path, &map_size_);
+    size_t offset = 0u;
+    try {
+        offset = read_file_header(map_, map_size_, path, &checkpoint_);
+        if (offset == 0u) throw std::runtime_error("incomplete binary result file: " + path);
+    } catch (...) {
+        unmap();
+        throw;
+    }
+    const size_t num_columns = checkpoint_.num_columns;
+    const size_t data_begin = offset;
+    while (offset + block_header_size <= map_size_) {
+        const auto num_rows = read_pod<uint64_t>(map_ + offset);
+        const auto stored_size = read_pod<uint64_t>(map_ + offset + sizeof(uint64_t));
+        const char* payload = map_ + offset + block_header_size;
+        const size_t footer_pos = offset + block_header_size + padded_size(stored_size);
+        if (footer_pos < offset || footer_pos > map_size_) break;
+        ColumnarCheckpoint next = checkpoint_;
+        if (!read_footer(map_, map_size_, footer_pos, data_begin, &next)
+            || next.num_rows != checkpoint_.num_rows + num_rows) break;
+        const size_t raw_size = num_rows * num_columns * sizeof(double);
+        if (checkpoint_.compressed) {
+            std::vector<double> buffer(num_rows * num_columns);
+            uLongf dest_size = static_cast<uLongf>(raw_size);
+            if (uncompress(reinterpret_cast<Bytef*>(buffer.data()), &dest_size,
+                           reinterpret_cast<const Bytef*>(payload), stored_size) != Z_OK
+                || dest_size != raw_size) break;
+            decompressed_.push_back(std::move(buffer));
+            blocks_.push_back(Block{checkpoint_.num_rows, num_rows, decompressed_.back().data()});
+        } else {
+            if (stored_size != raw_size) break;
+            blocks_.push_back(Block{checkpoint_.num_rows, num_rows, reinterpret_cast<const double*>(payload)});
+        }
+        checkpoint_ = std::move(next);
+        offset = checkpoint_.valid_size;
+    }
+}
+
+ColumnarReader::~ColumnarReader() {
+    unmap();
+}
+
+void ColumnarReader::unmap() {
+    unmap_file(map_, map_size_);
+    map_ = nullptr;
+}
+
+std::vector<std::string> ColumnarReader::colnames() const {
+    const std::string& header = checkpoint_.header;
+    const auto pos = header.rfind('\n', header.size() - 2u);
+    std::string line = header.substr(pos == std::string::npos ? 0u : pos + 1u);
+    return wtl::split(line, "\t\n");
+}
+
+const ColumnarReader::Block& ColumnarReader::find_block(const size_t row) const {
+    const auto it = std::upper_bound(blocks_.begin(), blocks_.end(), row,
+        [](const size_t r, const Block& b) {return r < b.first_row;});
+    return *(it - 1);
+}
+
+double ColumnarReader::at(const size_t row, const size_t col) const {
+    const Block& block = find_block(row);
+    return block.data[col * block.num_rows + (row - block.first_row)];
+}
+
+std::valarray<double> ColumnarReader::params(const size_t row) const {
+    const Block& block = find_block(row);
+    std::valarray<double> values(checkpoint_.num_columns - 1u);
+    for (size_t j=1u; j<checkpoint_.num_columns; ++j) {
+        values[j - 1u] = block.data[j * block.num_rows + (row - block.first_row)];
+    }
+    return values;
+}
+
+std::valarray<double> ColumnarReader::column(const size_t col) const {
+    std::valarray<double> values(checkpoint_.num_rows);
+    for (const auto& block: blocks_) {
+        std::copy(block.data + col * block.num_rows,
+                  block.data + (col + 1u) * block.num_rows,
+                  std::begin(values) + block.first_row);
+    }
+    return values;
+}
+
+ColumnarCheckpoint read_checkpoint(const std::string& path) {
+    size_t size = 0u;
+    const char* map = map_file(path, &size);
+    ColumnarCheckpoint checkpoint;
+    try {
+        const size_t data_begin = read_file_header(map, size, path, &checkpoint);
+        if (data_begin == 0u) {
+            unmap_file(map, size);
+            return checkpoint;
+        }
+        const size_t footer_bytes = footer_size(checkpoint.num_columns);
+        const size_t min_pos = data_begin + block_header_size;
+        if (size >= min_pos + footer_bytes) {
+            // everything is 8-byte aligned; search backward past a torn tail
+            for (size_t pos = (size - footer_bytes) / sizeof(double) * sizeof(double);
+                 pos >= min_pos; pos -= sizeof(double)) {
+                if (read_footer(map, size, pos, data_begin, &checkpoint)) break;
+            }
+        }
+    } catch (...) {
+        unmap_file(map, size);
+        throw;
+    }
+    unmap_file(map, size);
+    return checkpoint;
+}
+
+bool is_columnar(const std::string& path) {
+    std::ifstream ifs(path, std::ios::binary);
+    char buffer[sizeof(columnar::magic)] = {};
+    ifs.read(buffer, sizeof(buffer));
+    return ifs && std::memcmp(buffer, columnar::magic, sizeof(buffer)) == 0;
+}
+
+void write_tsv(const ColumnarReader& reader, std::ostream& ost) {
+    ost << reader.header();
+    for (size_t i=0u; i<reader.num_rows(); ++i) {
+        ost << reader.loglik(i) << "\t";
+        wtl::join(reader.params(i), ost, "\t") << "\n";
+    }
+}
+
+} // namespace likeligrid
@@ -0,0 +1,152 @@
+/*! @file columnar.hpp
+    @brief Interface of binary columnar result files
+*/
+#pragma once
+#ifndef LIKELIGRID_COLUMNAR_HPP_
+#define LIKELIGRID_COLUMNAR_HPP_
+
+#include <iosfwd>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <valarray>
+#include <limits>
+
+namespace likeligrid {
+
+/*! @brief Layout of binary result files
+
+    File header:
+    magic "LGRIDBIN", uint32 version, uint32 flags, uint64 number of columns,
+    uint64 length of the text header and the text header itself,
+    i.e., the `##` metadata and column names of the TSV format,
+    padded with zeros to a multiple of 8 bytes.
+
+    Each block:
+    uint64 number of rows, uint64 stored bytes, and the stored bytes
+    padded with zeros to a multiple of 8 bytes;
+    the payload is column-major doubles (loglik, then parameters),
+    compressed with zlib if the flag is set.
+
+    Each block is followed by a checkpoint footer:
+    magic "LGRIDCKP", uint64 offset of the block, uint64 rows so far,
+    double max loglik so far and the parameters at it,
+    uint32 crc32 of the stored bytes, uint32 crc32 of the footer before it.
+    The last footer summarizes the whole file,
+    so resuming does not have to read the rows.
+    A truncated block at the end is ignored.
+*/
+namespace columnar {
+    constexpr char magic[8] = {'L', 'G', 'R', 'I', 'D', 'B', 'I', 'N'};
+    constexpr char checkpoint_magic[8] = {'L', 'G', 'R', 'I', 'D', 'C', 'K', 'P'};
+    constexpr uint32_t version = 2u;
+    constexpr uint32_t zlib_flag = 1u;
+}
+
+//! Summary of a file up to its last intact block
+struct ColumnarCheckpoint {
+    std::string header;
+    size_t num_columns = 0u;
+    bool compressed = false;
+    //! the last column is APPROXIMATE
+    bool approximate = false;
+    //! Bytes of the file header and intact blocks
+    size_t valid_size = 0u;
+    size_t num_rows = 0u;
+    //! of the rows not flagged as approximate
+    double max_loglik = std::numeric_limits<double>::lowest();
+    //! at max_loglik without the APPROXIMATE column; ties are broken toward the neutral point
+    std::valarray<double> mle_params;
+};
+
+//! Append rows to a binary result file block by block
+class ColumnarWriter {
+  public:
+    /*! @brief Create a new file, or append to a complete prefix of an existing file
+
+        `header` and `compress` are used only for a new file.
+    */
+    ColumnarWriter(const std::string& path, const std::string& header,
+                   size_t num_columns, bool compress=false);
+    ~ColumnarWriter();
+    ColumnarWriter(const ColumnarWriter&) = delete;
+    ColumnarWriter& operator=(const ColumnarWriter&) = delete;
+
+    //! Rows flagged in the APPROXIMATE column are not candidates of MLE
+    void push_back(double loglik, const std::valarray<double>& params);
+    //! Write buffered rows as a block with its checkpoint
+    void flush();
+
+  private:
+    //! Update the MLE of the checkpoint
+    void compete(double loglik, const std::valarray<double>& params);
+
+    std::ofstream ofs_;
+    const size_t num_columns_;
+    bool compress_;
+    //! running summary of the rows written so far
+    ColumnarCheckpoint checkpoint_;
+    //! column-major buffer
+    std::vector<std::vector<double>> columns_;
+    const size_t block_rows_ = 4096u;
+};
+
+//! Read-only view of a binary result file through mmap
+class ColumnarReader {
+  public:
+    //! throw std::ios_base::failure if the file cannot be opened
+    explicit ColumnarReader(const std::string& path);
+    ~ColumnarReader();
+    ColumnarReader(const ColumnarReader&) = delete;
+    ColumnarReader& operator=(const ColumnarReader&) = delete;
+
+    const std::string& header() const {return checkpoint_.header;}
+    std::vector<std::string> colnames() const;
+    size_t num_rows() const {return checkpoint_.num_rows;}
+    size_t num_columns() const {return checkpoint_.num_columns;}
+    //! Bytes of the file header and intact blocks
+    size_t valid_size() const {return checkpoint_.valid_size;}
+    bool compressed() const {return checkpoint_.compressed;}
+    //! Footer of the last intact block
+    const ColumnarCheckpoint& checkpoint() const {return checkpoint_;}
+
+    double at(size_t row, size_t col) const;
+    double loglik(size_t row) const {return at(row, 0u);}
+    std::valarray<double> params(size_t row) const;
+    std::valarray<double> column(size_t col) const;
+
+  private:
+    struct Block {
+        size_t first_row;
+        size_t num_rows;
+        //! into the mapping or decompressed_
+        const double* data;
+    };
+    const Block& find_block(size_t row) const;
+    void unmap();
+
+    const char* map_ = nullptr;
+    size_t map_size_ = 0u;
+    ColumnarCheckpoint checkpoint_;
+    std::vector<Block> blocks_;
+    std::vector<std::vector<double>> decompressed_;
+};
+
+/*! @brief Read the file header and the last intact footer without reading rows
+
+    Only the tail of the file is examined unless it is corrupted.
+    A file shorter than its file header is treated as absent with valid_size 0.
+    throw std::ios_base::failure if the file cannot be opened
+*/
+ColumnarCheckpoint read_checkpoint(const std::string& path);
+
+//! Check the magic bytes at the beginning of the file
+bool is_columnar(const std::string& path);
+
+//! Export in the TSV format
+void write_tsv(const ColumnarReader&, std::ostream&);
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_COLUMNAR_HPP_
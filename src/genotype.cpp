@@ -2,7 +2,11 @@
     @brief Implementation of GenotypeModel class
 */
 #include "genotype.hpp"
+#include "samples.hpp"
+#include "bits.hpp"
 #include "util.hpp"
+#include "parallel.hpp"
+#include "logsumexp.hpp"
 
 #include <wtl/debug.hpp>
 #include <wtl/chrono.hpp>
@@ -12,53 +16,313 @@
 #include <wtl/math.hpp>
 #include <wtl/exception.hpp>
 
-#include <clippson/json.hpp>
+#include <unistd.h>
+
+#include <map>
+#include <numeric>
+#include <iomanip>
 
 namespace likeligrid {
 
-GenotypeModel::GenotypeModel(const std::string& infile, const size_t max_sites)
-: filename_(infile) {
-    HERE;
-    wtl::zlib::ifstream ist(filename_);
-    init(ist, max_sites);
-}
-
-void GenotypeModel::init(std::istream& ist, const size_t max_sites) {HERE;
-    nlohmann::json jso;
-    ist >> jso;
-    names_ = jso["pathway"].get<std::vector<std::string>>();
-    num_pathways_ = names_.size();
-    annot_.reserve(num_pathways_);
-    for (const std::string& s: jso["annotation"]) {
-        annot_.emplace_back(s);
-    }
-    std::cerr << "annot_: " << annot_ << std::endl;
-
-    const size_t nsam = jso["sample"].size();
-    std::vector<bits_t> all_genotypes;
-    all_genotypes.reserve(nsam);
-    for (const std::string& s: jso["sample"]) {
-        all_genotypes.emplace_back(s);
-    }
-
-    genot_.reserve(nsam);
-    num_genes_ = jso["sample"].at(0u).get<std::string>().size();
-    nsam_with_s_.assign(num_genes_ + 1u, 0u);  // at most
-    std::valarray<double> s_gene(num_genes_);
-    for (const auto& bits: all_genotypes) {
-        const size_t s = bits.count();
-        ++nsam_with_s_[s];
-        if (s > max_sites) continue;
-        genot_.push_back(bits);
-        for (size_t j=0u; j<num_genes_; ++j) {
-            if (bits[j]) ++s_gene[j];
-        }
-    }
-    wtl::rstrip(&nsam_with_s_);
-    std::cerr << "Original N_s: " << nsam_with_s_ << std::endl;
-    if (max_sites + 1u < nsam_with_s_.size()) {
-        nsam_with_s_.resize(max_sites + 1u);
-        std::cerr << "Using N_s: " << nsam_with_s_ << std::endl;
+//! Set of mutated genes in the reference recursion
+using GeneBits = Bits<0u>;
+
+inline double slice_sum(const std::valarray<double>& ln_coefs, const std::vector<size_t>& indices) {
+    double lnp = 0.0;
+    for (const auto j: indices) {
+        lnp += ln_coefs[j];
+    }
+    return lnp;
+}
+
+//! Next combination b[0] < ... < b[s-1] < max_b in colex order
+inline void next_combination(std::vector<size_t>* b, const size_t max_b) {
+    const size_t s = b->size();
+    for (size_t i=0u; i<s; ++i) {
+        if ((*b)[i] + 1u < ((i + 1u < s) ? (*b)[i + 1u] : max_b)) {
+            ++(*b)[i];
+            std::iota(b->begin(), b->begin() + i, 0u);
+            break;
+        }
+    }
+}
+
+inline double sub_lnp(const double ln_bigger, const double ln_smaller) {
+    return ln_bigger + std::log1p(-std::exp(ln_smaller - ln_bigger));
+}
+
+inline double add_lnp(const double lhs, const double rhs) {
+    const double bigger = std::max(lhs, rhs);
+    if (bigger == -std::numeric_limits<double>::infinity()) return bigger;
+    return bigger + std::log1p(std::exp(std::min(lhs, rhs) - bigger));
+}
+
+template <class PathBits>
+class GenotypeModel::DatasetImpl: public GenotypeModel::Dataset {
+  public:
+    DatasetImpl(Samples&& samples, size_t max_sites, const std::string& filename);
+
+    double calc_loglik(const GenotypeModel& model,
+                       const std::valarray<double>& theta,
+                       unsigned int concurrency,
+                       std::valarray<double>* gradient,
+                       double* skipped) const override;
+    std::vector<double> calc_loglik_batch(const GenotypeModel& model,
+                                          const std::vector<std::valarray<double>>& thetas,
+                                          unsigned int concurrency) const override {
+        return calc_loglik_batch<double>(model, thetas, concurrency);
+    }
+    std::vector<double> approx_loglik_batch(const GenotypeModel& model,
+                                            const std::vector<std::valarray<double>>& thetas,
+                                            unsigned int concurrency) const override {
+        return calc_loglik_batch<float>(model, thetas, concurrency);
+    }
+    AxisLoglik calc_axis(const GenotypeModel& model,
+                         const std::valarray<double>& theta, size_t k,
+                         double lower, double upper,
+                         unsigned int concurrency) const override;
+
+  private:
+    //! Genes with the same signature and weight are interchangeable
+    struct GeneClass {
+        size_t sig;
+        double w;
+        size_t size;
+    };
+
+    //! Evaluation state of a calc_loglik() call
+    struct Workspace {
+        Workspace(const GenotypeModel& m, const std::valarray<double>& theta,
+                  unsigned int c, bool g)
+        : model(m), ln_theta(std::log(theta)), concurrency(c), gradient(g) {}
+
+        const GenotypeModel& model;
+        std::valarray<double> ln_theta;
+        std::valarray<double> ln_denoms;
+        unsigned int concurrency;
+        //! theta terms indexed by (pathtype id, signature id)
+        std::vector<double> ln_theta_terms;
+        std::vector<double> theta_terms;
+
+        //! derivatives with respect to ln theta are propagated if true
+        bool gradient;
+        //! parameters in theta term i are term_params[term_params_begin[i]...]
+        std::vector<size_t> term_params_begin;
+        std::vector<size_t> term_params;
+        //! d ln D_s / d ln theta
+        std::vector<std::valarray<double>> dln_denoms;
+        //! bound of the mass skipped by pruning relative to D_s; the max over s
+        double skipped = 0.0;
+    };
+
+    //! Accumulator of a subtree in the reference recursion
+    struct Subtree {
+        std::vector<LogSumExp> ln_denoms;
+        //! log of the share of the pruning tolerance; -inf if disabled
+        double ln_budget;
+        //! max of the theta terms
+        double ln_max_term;
+        //! lower bounds of ln D_s found so far
+        std::vector<double> ln_floors;
+        //! log of the upper bounds of the mass skipped at each depth
+        std::vector<double> ln_skipped;
+    };
+
+    //! Evaluation state of a calc_loglik_batch() call;
+    //! values of theta i are interleaved as [index * batch + i]
+    template <class T> struct BatchWorkspace {
+        size_t batch;
+        unsigned int concurrency;
+        std::vector<T> theta_terms;
+    };
+
+    void init_signatures(const std::vector<PathBits>& effects);
+    void init_sigtypes();
+    void init_gene_classes();
+    void init_pathtypes();
+    void init_theta_terms(Workspace* ws) const;
+    void init_term_params(Workspace* ws) const;
+
+    //! Sum over orderings of theta terms; gene weights are in lnp_const_
+    double lnp_sample(const Workspace& ws, const std::vector<size_t>& genotype) const;
+    //! `dlnp` receives d lnp / d ln theta if ws.gradient
+    double lnp_sample_dp(const Workspace& ws, const std::vector<size_t>& genotype,
+                         std::valarray<double>* dlnp) const;
+
+    double sum_lnp_samples(const Workspace& ws, std::valarray<double>* gradient) const;
+
+    void calc_denoms_recursion(Workspace* ws) const;
+    std::vector<double> greedy_path(const Workspace& ws) const;
+    void mutate(const Workspace& ws, Subtree* subtree,
+                const GeneBits& genotype, size_t pathtype,
+                double anc_lnp, double open_lnp) const;
+    void mutate_gene(const Workspace& ws, Subtree* subtree,
+                     size_t j, const GeneBits& genotype, size_t pathtype,
+                     double anc_lnp, double open_lnp) const;
+    bool prune(Subtree* subtree, size_t s, double lnp) const;
+
+    //! Probabilities and theta terms are of type T; sums and logarithms are double
+    template <class T>
+    std::vector<double> calc_loglik_batch(const GenotypeModel& model,
+                                          const std::vector<std::valarray<double>>& thetas,
+                                          unsigned int concurrency) const;
+    template <class T>
+    BatchWorkspace<T> init_batch(const GenotypeModel& model,
+                                 const std::vector<std::valarray<double>>& thetas,
+                                 unsigned int concurrency) const;
+    //! Set lnp[i] for each theta in the batch
+    template <class T>
+    void lnp_sample_batch(const BatchWorkspace<T>& ws, const std::vector<size_t>& genotype, double* lnp) const;
+    template <class T>
+    std::vector<double> sum_lnp_samples_batch(const BatchWorkspace<T>& ws) const;
+
+    void calc_denoms_dp(Workspace* ws) const;
+    //! ln D_s of theta i at [s * batch + i]
+    template <class T>
+    std::vector<double> calc_denoms_dp_batch(const BatchWorkspace<T>& ws) const;
+    template <class T>
+    void calc_dp_states_batch(const BatchWorkspace<T>& ws, size_t s, size_t begin, size_t end,
+                              const std::vector<T>& prev_f, std::vector<T>* f) const;
+    //! Set the combination b of rank `rank` in colex order
+    void unrank_combination(size_t rank, size_t max_b, std::vector<size_t>* b) const;
+    //! `df` is filled with derivatives of `f` if ws.gradient
+    void calc_dp_states(const Workspace& ws, size_t s, size_t begin, size_t end,
+                        const std::vector<double>& prev_f, std::vector<double>* f,
+                        const std::vector<double>& prev_df, std::vector<double>* df) const;
+
+    double ln_theta_if_subset(const Workspace& ws,
+                              const PathBits& pathtype, const PathBits& mut_path) const {
+        if (!mut_path.is_subset_of(pathtype)) return 0.0;
+        double lnp = 0.0;
+        mut_path.for_each([&ws,&lnp](const size_t i) {lnp += ws.ln_theta[i];});
+        return lnp;
+    }
+
+    //! Index of the epistasis or pleiotropy parameter to apply, or -1
+    size_t paired_index(const GenotypeModel& model,
+                        const PathBits& pathtype, const PathBits& mut_path) const {
+        if (!model.epistasis_) return -1u;
+        const auto& pair = model.epistasis_pair_;
+        if (pathtype[pair.first]) {
+            if (pathtype[pair.second]) return -1u;
+            if (mut_path[pair.second]) return model.epistasis_idx_;
+        }
+        if (pathtype[pair.second]) {
+            if (mut_path[pair.first]) return model.epistasis_idx_;
+        }
+        if (mut_path[pair.first]) {
+            if (mut_path[pair.second]) return model.pleiotropy_idx_;
+        }
+        return -1u;
+    }
+
+    double ln_theta_term(const Workspace& ws,
+                         const PathBits& pathtype, const PathBits& mut_path) const {
+        double lnp = ln_theta_if_subset(ws, pathtype, mut_path);
+        const size_t k = paired_index(ws.model, pathtype, mut_path);
+        if (k != -1u) {lnp += ws.ln_theta[k];}
+        return lnp;
+    }
+
+    //! d/d ln theta of a path through term `idx` with probability `p`
+    void add_term_params(const Workspace& ws, const size_t idx, const double p, double* dp) const {
+        for (size_t i=ws.term_params_begin[idx]; i<ws.term_params_begin[idx + 1u]; ++i) {
+            dp[ws.term_params[i]] += p;
+        }
+    }
+
+    size_t term_index(const size_t pathtype, const size_t sig) const {
+        return pathtype * signatures_.size() + sig;
+    }
+    //! Pathtype id after a gene with `sig` is mutated in `pathtype`
+    size_t next_pathtype(const size_t pathtype, const size_t sig) const {
+        return pt_next_[term_index(pathtype, sig)];
+    }
+
+    double sum_ln_theta(const Workspace& ws, const std::vector<size_t>& mut_route) const {
+        double lnp = 0.0;
+        size_t pathtype = 0u;
+        for (size_t i=0u; i<mut_route.size(); ++i) {
+            const size_t sig = gene_sig_[mut_route[i]];
+            lnp += ws.ln_theta_terms[term_index(pathtype, sig)];
+            if (i + 1u < mut_route.size()) {pathtype = next_pathtype(pathtype, sig);}
+        }
+        return lnp;
+    }
+
+    //! unique genotype as indices of mutated genes, and the number of samples
+    std::vector<std::pair<std::vector<size_t>, size_t>> genot_;
+    std::valarray<double> ln_w_gene_;
+    //! distinct effects of the mutated genes
+    std::vector<PathBits> signatures_;
+    //! signature id of each gene; -1 if it is not mutated in any sample
+    std::vector<size_t> gene_sig_;
+    //! unions of signatures reachable by max_sites - 1 mutations; 0 is empty
+    std::vector<PathBits> pathtypes_;
+    //! pt_next_[term_index(pathtype, sig)]; -1 beyond max_sites - 1 mutations
+    std::vector<uint32_t> pt_next_;
+    //! Samples sharing the sorted sequence of gene signatures share theta terms;
+    //! representative genotype and the number of samples
+    std::vector<std::pair<std::vector<size_t>, size_t>> sigtypes_;
+    double lnp_const_ = 0.0;
+    std::vector<GeneClass> gene_classes_;
+    //! binom_[n][r] for ranking multisets of gene classes
+    std::vector<std::vector<size_t>> binom_;
+};
+
+std::shared_ptr<const GenotypeModel::Dataset>
+GenotypeModel::load(std::istream& ist, const size_t max_sites, const std::string& filename) {HERE;
+    auto samples = read_samples(ist, max_sites);
+    const size_t num_pathways = samples.names.size();
+    if (num_pathways <= 64u) {
+        return std::make_shared<const DatasetImpl<Bits<64u>>>(std::move(samples), max_sites, filename);
+    } else if (num_pathways <= 128u) {
+        return std::make_shared<const DatasetImpl<Bits<128u>>>(std::move(samples), max_sites, filename);
+    } else if (num_pathways <= 256u) {
+        return std::make_shared<const DatasetImpl<Bits<256u>>>(std::move(samples), max_sites, filename);
+    }
+    return std::make_shared<const DatasetImpl<Bits<0u>>>(std::move(samples), max_sites, filename);
+}
+
+GenotypeModel::GenotypeModel(const std::string& infile, const size_t max_sites) {HERE;
+    wtl::zlib::ifstream ist(infile);
+    data_ = load(ist, max_sites, infile);
+    names_ = data_->names;
+    init_engine();
+}
+
+double GenotypeModel::memory_limit() {
+    const double pages = static_cast<double>(::sysconf(_SC_PHYS_PAGES));
+    return 0.5 * pages * static_cast<double>(::sysconf(_SC_PAGE_SIZE));
+}
+
+// The recursion holds only a path at a time, but takes time exponential in max_sites.
+void GenotypeModel::init_engine() {HERE;
+    if (dp_bytes() > memory_limit()) {
+        std::cerr << "Warning: DP needs " << dp_bytes() * 1e-9
+                  << " GB per theta; falling back to the recursion" << std::endl;
+        engine_ = Engine::recursion;
+    }
+}
+
+template <class PathBits>
+GenotypeModel::DatasetImpl<PathBits>::DatasetImpl(
+  Samples&& samples, const size_t max_sites, const std::string& infile) {HERE;
+    filename = infile;
+    names = std::move(samples.names);
+    num_pathways = names.size();
+    const auto& annot = samples.annotation;
+    std::cerr << "annot: " << annot << std::endl;
+    digest = samples.digest;
+    num_genes = samples.num_genes;
+    nsam_with_s = std::move(samples.nsam_with_s);
+    genot_ = std::move(samples.genotypes);
+    const std::valarray<double>& s_gene = samples.s_gene;
+    wtl::rstrip(&nsam_with_s);
+    std::cerr << "Original N_s: " << nsam_with_s << std::endl;
+    if (max_sites + 1u < nsam_with_s.size()) {
+        nsam_with_s.resize(max_sites + 1u);
+        std::cerr << "Using N_s: " << nsam_with_s << std::endl;
     } else {
         std::cerr << "Note: -s is too large" << std::endl;
     }
@@ -67,19 +331,140 @@ void GenotypeModel::init(std::istream& ist, const size_t max_sites) {HERE;
     std::cerr << "s_gene: " << s_gene << std::endl;
     std::cerr << "w_gene: " << w_gene << std::endl;
     std::cerr << "ln_w_gene_: " << ln_w_gene_ << std::endl;
+    std::cerr << "unique genotypes: " << genot_.size() << std::endl;
 
-    max_sites_ = nsam_with_s_.size() - 1u;
-    effects_.reserve(num_genes_);
-    for (size_t j=0u; j<num_genes_; ++j) {
-        effects_.emplace_back(translate(j));
+    this->max_sites = nsam_with_s.size() - 1u;
+    std::vector<PathBits> effects(num_genes, PathBits(num_pathways));
+    for (size_t i=0u; i<num_pathways; ++i) {
+        for (const auto j: to_indices(annot[i])) {
+            effects.at(j).set(i);
+        }
+    }
+    init_signatures(effects);
+    init_sigtypes();
+    init_gene_classes();
+    init_pathtypes();
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::init_signatures(const std::vector<PathBits>& effects) {HERE;
+    std::map<PathBits, size_t> signature_index;
+    gene_sig_.assign(num_genes, -1u);
+    for (size_t j=0u; j<num_genes; ++j) {
+        if (ln_w_gene_[j] == -std::numeric_limits<double>::infinity()) continue;
+        const auto inserted = signature_index.emplace(effects[j], signatures_.size());
+        if (inserted.second) {
+            signatures_.push_back(effects[j]);
+        }
+        gene_sig_[j] = inserted.first->second;
     }
-    // std::cerr << "effects_: " << effects_ << std::endl;
+    std::cerr << "signatures: " << signatures_.size() << std::endl;
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::init_sigtypes() {HERE;
+    std::map<std::vector<size_t>, size_t> sigtype_index;
+    for (const auto& p: genot_) {
+        std::vector<size_t> key;
+        key.reserve(p.first.size());
+        for (const auto j: p.first) {
+            key.push_back(gene_sig_[j]);
+        }
+        std::sort(key.begin(), key.end());
+        const auto inserted = sigtype_index.emplace(key, sigtypes_.size());
+        if (inserted.second) {
+            sigtypes_.emplace_back(p.first, 0u);
+        }
+        sigtypes_[inserted.first->second].second += p.second;
+        lnp_const_ += p.second * slice_sum(ln_w_gene_, p.first);
+    }
+    std::cerr << "unique signature sequences: " << sigtypes_.size() << std::endl;
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::init_gene_classes() {HERE;
+    std::map<std::pair<size_t, double>, size_t> class_index;
+    for (size_t j=0u; j<num_genes; ++j) {
+        if (ln_w_gene_[j] == -std::numeric_limits<double>::infinity()) continue;
+        const auto key = std::make_pair(gene_sig_[j], ln_w_gene_[j]);
+        auto it = class_index.find(key);
+        if (it == class_index.end()) {
+            it = class_index.emplace(key, gene_classes_.size()).first;
+            gene_classes_.push_back(GeneClass{gene_sig_[j], std::exp(ln_w_gene_[j]), 0u});
+        }
+        ++gene_classes_[it->second].size;
+    }
+    std::cerr << "gene classes: " << gene_classes_.size() << std::endl;
+    // multisets of size s from K classes <-> s-combinations from K+s-1
+    const size_t max_n = gene_classes_.size() + max_sites;
+    binom_.assign(max_n + 1u, std::vector<size_t>(max_sites + 1u, 0u));
+    for (size_t n=0u; n<=max_n; ++n) {
+        binom_[n][0u] = 1u;
+        for (size_t r=1u; r<=std::min(n, max_sites); ++r) {
+            binom_[n][r] = binom_[n - 1u][r - 1u] + (r < n ? binom_[n - 1u][r] : 0u);
+        }
+    }
+    // multiplied in double not to overflow; the DP is not run if it does not fit in memory
+    double num_states = 1.0;
+    for (size_t r=1u; r<=max_sites; ++r) {
+        const double prev_states = num_states;
+        num_states *= static_cast<double>(gene_classes_.size() + r - 1u) / r;
+        max_dp_states = std::max(max_dp_states, prev_states + num_states);
+    }
+    std::cerr << "DP states at s=" << max_sites << ": " << num_states << std::endl;
+}
+
+// Breadth-first search from the empty pathtype.
+// Transitions are needed only from pathtypes of at most max_sites - 2 mutations.
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::init_pathtypes() {HERE;
+    constexpr size_t max_terms = size_t(1u) << 24u;
+    const size_t num_sigs = signatures_.size();
+    std::map<PathBits, size_t> pathtype_index;
+    pathtype_index.emplace(PathBits(num_pathways), 0u);
+    pathtypes_.assign(1u, PathBits(num_pathways));
+    size_t frontier_begin = 0u;
+    for (size_t depth=0u; depth + 2u <= max_sites; ++depth) {
+        const size_t frontier_end = pathtypes_.size();
+        for (size_t pt=frontier_begin; pt<frontier_end; ++pt) {
+            for (size_t sig=0u; sig<num_sigs; ++sig) {
+                const PathBits next = pathtypes_[pt] | signatures_[sig];
+                const auto inserted = pathtype_index.emplace(next, pathtypes_.size());
+                if (inserted.second) {
+                    pathtypes_.push_back(next);
+                }
+            }
+        }
+        if (pathtypes_.size() * num_sigs > max_terms) {
+            throw std::runtime_error("too many pathtypes; decrease -s");
+        }
+        frontier_begin = frontier_end;
+    }
+    pt_next_.assign(pathtypes_.size() * num_sigs, static_cast<uint32_t>(-1));
+    for (size_t pt=0u; pt<frontier_begin; ++pt) {
+        for (size_t sig=0u; sig<num_sigs; ++sig) {
+            const size_t next = pathtype_index.at(pathtypes_[pt] | signatures_[sig]);
+            pt_next_[term_index(pt, sig)] = static_cast<uint32_t>(next);
+        }
+    }
+    std::cerr << "pathtypes: " << pathtypes_.size() << std::endl;
+}
+
+std::string GenotypeModel::fingerprint() const {
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0') << std::setw(16) << data_->digest << std::dec
+        << "-s" << data_->max_sites;
+    if (epistasis_) {
+        oss << "-e" << epistasis_pair_.first << "x" << epistasis_pair_.second;
+        if (pleiotropy_idx_ != epistasis_idx_) oss << "-p";
+    }
+    return oss.str();
 }
 
 bool GenotypeModel::set_epistasis(const std::pair<size_t, size_t>& pair, const bool pleiotropy) {HERE;
     if (pair.first == pair.second) return false;
     epistasis_pair_ = pair;
-    pleiotropy_idx_ = epistasis_idx_ = num_pathways_;
+    pleiotropy_idx_ = epistasis_idx_ = data_->num_pathways;
     std::ostringstream oss;
     oss << names_.at(pair.first) << ":" << names_.at(pair.second);
     names_.push_back(oss.str());
@@ -92,88 +477,652 @@ bool GenotypeModel::set_epistasis(const std::pair<size_t, size_t>& pair, const b
     return epistasis_ = true;
 }
 
-double GenotypeModel::calc_loglik(const std::valarray<double>& theta) {
-    ln_theta_ = std::log(theta);
-    // std::cerr << "denoms_: " << denoms_ << std::endl;
-    double loglik = 0.0;
-    for (const auto& genotype: genot_) {
-        loglik += lnp_sample(genotype);
+template <class PathBits>
+double GenotypeModel::DatasetImpl<PathBits>::calc_loglik(
+  const GenotypeModel& model, const std::valarray<double>& theta, const unsigned int concurrency,
+  std::valarray<double>* gradient, double* skipped) const {
+    if (skipped) {*skipped = 0.0;}
+    if (!gradient && model.engine_ == Engine::dp) {
+        // the same arithmetic as in any batch
+        return calc_loglik_batch(model, {theta}, concurrency)[0u];
     }
-    ln_denoms_.resize(max_sites_ + 1u);
-    ln_denoms_ = -std::numeric_limits<double>::infinity();
-    mutate();
-    // std::cerr << "lnD: " << ln_denoms_ << std::endl;
+    Workspace ws(model, theta, concurrency, gradient != nullptr);
+    if (ws.gradient) {
+        if (model.engine_ != Engine::dp) {
+            throw std::runtime_error("gradient is implemented only in Engine::dp");
+        }
+        init_term_params(&ws);
+    }
+    init_theta_terms(&ws);
+    double loglik = lnp_const_;
+    loglik += sum_lnp_samples(ws, gradient);
+    ws.ln_denoms.resize(max_sites + 1u);
+    ws.ln_denoms = -std::numeric_limits<double>::infinity();
+    if (model.engine_ == Engine::dp) {
+        calc_denoms_dp(&ws);
+    } else {
+        calc_denoms_recursion(&ws);
+    }
+    // std::cerr << "lnD: " << ws.ln_denoms << std::endl;
     // -inf, 0, D2, D3, ...
-    for (size_t s=2u; s<=max_sites_; ++s) {
-        loglik -= nsam_with_s_[s] * ln_denoms_[s];
+    for (size_t s=2u; s<=max_sites; ++s) {
+        loglik -= nsam_with_s[s] * ws.ln_denoms[s];
+        if (ws.gradient) {*gradient -= static_cast<double>(nsam_with_s[s]) * ws.dln_denoms[s];}
     }
+    if (ws.gradient) {*gradient /= theta;}
+    if (skipped) {*skipped = ws.skipped;}
     return loglik;
 }
 
-inline std::valarray<size_t> to_indices(const bits_t& bits) {
-    std::valarray<size_t> indices(bits.count());
-    for (size_t i=0u, j=0u; i<indices.size(); ++j) {
-        if (bits[j]) {
-            indices[i] = j;
-            ++i;
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::init_theta_terms(Workspace* ws) const {
+    const size_t num_sigs = signatures_.size();
+    ws->ln_theta_terms.resize(pathtypes_.size() * num_sigs);
+    ws->theta_terms.resize(ws->ln_theta_terms.size());
+    parallel_for(pathtypes_.size(), ws->concurrency, [&](const size_t pt) {
+        for (size_t sig=0u; sig<num_sigs; ++sig) {
+            const size_t idx = term_index(pt, sig);
+            ws->ln_theta_terms[idx] = ln_theta_term(*ws, pathtypes_[pt], signatures_[sig]);
+            ws->theta_terms[idx] = std::exp(ws->ln_theta_terms[idx]);
+        }
+    });
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::init_term_params(Workspace* ws) const {
+    const size_t num_sigs = signatures_.size();
+    ws->term_params_begin.reserve(pathtypes_.size() * num_sigs + 1u);
+    for (size_t pt=0u; pt<pathtypes_.size(); ++pt) {
+        for (size_t sig=0u; sig<num_sigs; ++sig) {
+            ws->term_params_begin.push_back(ws->term_params.size());
+            const PathBits& mut_path = signatures_[sig];
+            if (mut_path.is_subset_of(pathtypes_[pt])) {
+                mut_path.for_each([ws](const size_t i) {ws->term_params.push_back(i);});
+            }
+            const size_t k = paired_index(ws->model, pathtypes_[pt], mut_path);
+            if (k != -1u) {ws->term_params.push_back(k);}
         }
     }
-    return indices;
+    ws->term_params_begin.push_back(ws->term_params.size());
 }
 
-inline double slice_sum(const std::valarray<double>& ln_coefs, const bits_t& bits) {
-    double lnp = 0.0;
-    for (size_t i=0; i<ln_coefs.size(); ++i) {
-        if (bits[i]) lnp += ln_coefs[i];
+// Fixed chunks are summed in order regardless of concurrency.
+template <class PathBits>
+double GenotypeModel::DatasetImpl<PathBits>::sum_lnp_samples(const Workspace& ws, std::valarray<double>* gradient) const {
+    constexpr size_t chunk_size = 64u;
+    const size_t num_chunks = (sigtypes_.size() + chunk_size - 1u) / chunk_size;
+    const size_t num_params = ws.gradient ? ws.ln_theta.size() : 0u;
+    std::vector<double> partial_sums(num_chunks, 0.0);
+    std::vector<std::valarray<double>> partial_grads(num_chunks, std::valarray<double>(0.0, num_params));
+    parallel_for(num_chunks, ws.concurrency, [&](const size_t chunk) {
+        const size_t end = std::min((chunk + 1u) * chunk_size, sigtypes_.size());
+        std::valarray<double> dlnp(num_params);
+        for (size_t i=chunk * chunk_size; i<end; ++i) {
+            const double n = static_cast<double>(sigtypes_[i].second);
+            if (ws.gradient) {
+                partial_sums[chunk] += n * lnp_sample_dp(ws, sigtypes_[i].first, &dlnp);
+                partial_grads[chunk] += n * dlnp;
+            } else {
+                partial_sums[chunk] += n * lnp_sample(ws, sigtypes_[i].first);
+            }
+        }
+    });
+    if (ws.gradient) {
+        gradient->resize(num_params, 0.0);
+        for (const auto& x: partial_grads) {*gradient += x;}
     }
-    return lnp;
+    return std::accumulate(partial_sums.begin(), partial_sums.end(), 0.0);
 }
 
-inline double add_lnp(const double ln_bigger, const double ln_smaller) {
-    return ln_bigger + std::log1p(std::exp(ln_smaller - ln_bigger));
+template <class PathBits>
+double GenotypeModel::DatasetImpl<PathBits>::lnp_sample(const Workspace& ws, const std::vector<size_t>& genotype) const {
+    if (ws.model.engine_ == Engine::dp) return lnp_sample_dp(ws, genotype, nullptr);
+    LogSumExp lnp;
+    auto mut_route = genotype;
+    do {
+        lnp.push(sum_ln_theta(ws, mut_route));
+    } while (std::next_permutation(std::begin(mut_route), std::end(mut_route)));
+    return lnp.result();
 }
 
-inline double sub_lnp(const double ln_bigger, const double ln_smaller) {
-    return ln_bigger + std::log1p(-std::exp(ln_smaller - ln_bigger));
+// g[subset] is the sum over orderings of the mutated genes in the subset.
+// The term of the next gene depends only on the pathtype of the subset.
+// dg[subset * num_params + k] is the sum weighted by the exponent of theta_k.
+template <class PathBits>
+double GenotypeModel::DatasetImpl<PathBits>::lnp_sample_dp(const Workspace& ws, const std::vector<size_t>& genotype,
+                                                           std::valarray<double>* dlnp) const {
+    const size_t s = genotype.size();
+    const size_t num_subsets = size_t(1u) << s;
+    const size_t num_params = ws.gradient ? ws.ln_theta.size() : 0u;
+    std::vector<double> g(num_subsets, 0.0);
+    std::vector<double> dg(num_subsets * num_params, 0.0);
+    std::vector<size_t> pathtypes(num_subsets, 0u);
+    g[0u] = 1.0;
+    for (size_t subset=1u; subset<num_subsets; ++subset) {
+        if (subset + 1u < num_subsets) {
+            const size_t low = static_cast<size_t>(__builtin_ctzll(subset));
+            pathtypes[subset] = next_pathtype(pathtypes[subset ^ (size_t(1u) << low)], gene_sig_[genotype[low]]);
+        }
+        double p = 0.0;
+        for (size_t i=0u; i<s; ++i) {
+            const size_t bit = size_t(1u) << i;
+            if ((subset & bit) == 0u) continue;
+            const size_t prev = subset ^ bit;
+            const size_t idx = term_index(pathtypes[prev], gene_sig_[genotype[i]]);
+            const double t = ws.theta_terms[idx];
+            p += g[prev] * t;
+            if (ws.gradient) {
+                double* dst = &dg[subset * num_params];
+                const double* src = &dg[prev * num_params];
+                for (size_t k=0u; k<num_params; ++k) {dst[k] += src[k] * t;}
+                add_term_params(ws, idx, g[prev] * t, dst);
+            }
+        }
+        g[subset] = p;
+    }
+    if (ws.gradient) {
+        for (size_t k=0u; k<num_params; ++k) {
+            (*dlnp)[k] = dg[(num_subsets - 1u) * num_params + k] / g.back();
+        }
+    }
+    return std::log(g.back());
 }
 
-double GenotypeModel::lnp_sample(const bits_t& genotype) const {
-    double lnp = -std::numeric_limits<double>::infinity();
-    const double lnp_basic = slice_sum(ln_w_gene_, genotype);
-    auto mut_route = to_indices(genotype);
-    do {
-        lnp = add_lnp(lnp_basic + sum_ln_theta(mut_route), lnp);
-    } while (std::next_permutation(std::begin(mut_route), std::end(mut_route)));
-    return lnp;
+// Subtrees of the first mutations are evaluated separately and merged in order.
+// Each subtree may skip 1/num_genes of the tolerance times its lower bound of D_s,
+// so that the total skipped mass is at most the tolerance times D_s.
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::calc_denoms_recursion(Workspace* ws) const {
+    const size_t n = ws->ln_denoms.size();
+    Subtree seed;
+    seed.ln_denoms.resize(n);
+    seed.ln_skipped.assign(n, -std::numeric_limits<double>::infinity());
+    if (ws->model.pruning_ > 0.0) {
+        seed.ln_budget = std::log(ws->model.pruning_ / static_cast<double>(num_genes));
+        const auto minmax = std::minmax_element(ws->ln_theta_terms.begin(), ws->ln_theta_terms.end());
+        seed.ln_max_term = *minmax.second;
+        // D_s is also at least min_term^s
+        seed.ln_floors = greedy_path(*ws);
+        for (size_t s=1u; s<n; ++s) {
+            seed.ln_floors[s] = std::max(seed.ln_floors[s], static_cast<double>(s) * *minmax.first);
+        }
+    } else {
+        seed.ln_budget = -std::numeric_limits<double>::infinity();
+    }
+    std::vector<Subtree> subtrees(num_genes, seed);
+    parallel_for(num_genes, ws->concurrency, [&](const size_t j) {
+        mutate_gene(*ws, &subtrees[j], j, GeneBits(num_genes), 0u, 0.0, 0.0);
+    });
+    for (size_t s=1u; s<n; ++s) {
+        LogSumExp ln_denom;
+        LogSumExp ln_skipped;
+        for (auto& subtree: subtrees) {
+            ln_denom.push(subtree.ln_denoms[s].result());
+            ln_skipped.push(subtree.ln_skipped[s]);
+        }
+        ws->ln_denoms[s] = ln_denom.result();
+        // relative to the pruned D_s plus the bound, which is not less than D_s
+        const double ln_bound = ln_skipped.result();
+        ws->skipped = std::max(ws->skipped, std::exp(ln_bound - add_lnp(ws->ln_denoms[s], ln_bound)));
+    }
 }
 
-void GenotypeModel::mutate(const bits_t& genotype, const bits_t& pathtype, const double anc_lnp, const double open_lnp) {
-    const auto s = genotype.count() + 1u;
-    for (size_t j=0u; j<num_genes_; ++j) {
+// A single path is a lower bound of the denominator at each depth.
+// The most probable next gene is chosen greedily.
+template <class PathBits>
+std::vector<double> GenotypeModel::DatasetImpl<PathBits>::greedy_path(const Workspace& ws) const {
+    std::vector<double> lnps(max_sites + 1u, -std::numeric_limits<double>::infinity());
+    GeneBits genotype(num_genes);
+    size_t pathtype = 0u;
+    double lnp = 0.0;
+    double open_lnp = 0.0;
+    for (size_t s=1u; s<=max_sites; ++s) {
+        size_t best = -1u;
+        for (size_t j=0u; j<num_genes; ++j) {
+            if (genotype[j] || ln_w_gene_[j] == -std::numeric_limits<double>::infinity()) continue;
+            const double x = lnp + ln_w_gene_[j] - open_lnp + ws.ln_theta_terms[term_index(pathtype, gene_sig_[j])];
+            if (x > lnps[s]) {
+                lnps[s] = x;
+                best = j;
+            }
+        }
+        if (best == -1u) break;
+        lnp = lnps[s];
+        open_lnp = sub_lnp(open_lnp, ln_w_gene_[best]);
+        pathtype = next_pathtype(pathtype, gene_sig_[best]);
+        genotype.set(best);
+    }
+    return lnps;
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::mutate(const Workspace& ws, Subtree* subtree, const GeneBits& genotype, const size_t pathtype, const double anc_lnp, const double open_lnp) const {
+    for (size_t j=0u; j<num_genes; ++j) {
         if (genotype[j]) continue;
-        if (ln_w_gene_[j] == -std::numeric_limits<double>::infinity()) continue;
-        const bits_t& mut_path = effects_[j];
-        double lnp = anc_lnp;
-        lnp += ln_w_gene_[j];
-        lnp -= open_lnp;
-        lnp += ln_theta_if_subset(pathtype, mut_path);
-        if (epistasis_) {lnp += ln_theta_if_paired(pathtype, mut_path);}
-        ln_denoms_[s] = add_lnp(lnp, ln_denoms_[s]);
-        if (s < max_sites_) {
-            if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
-            mutate(bits_t(genotype).set(j), pathtype | mut_path, lnp, sub_lnp(open_lnp, ln_w_gene_[j]));
-        }
-    }
-}
-
-void GenotypeModel::benchmark(const size_t n) {
-    const std::valarray<double> param(0.9, num_pathways_);
-    double leaves = wtl::pow(static_cast<double>(num_genes_), static_cast<unsigned int>(max_sites_));
-    std::cerr << "# parameters: " << num_pathways_ << std::endl;
-    std::cerr << "width: " << num_genes_ << std::endl;
-    std::cerr << "depth: " << max_sites_ << std::endl;
+        mutate_gene(ws, subtree, j, genotype, pathtype, anc_lnp, open_lnp);
+    }
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::mutate_gene(const Workspace& ws, Subtree* subtree, const size_t j, const GeneBits& genotype, const size_t pathtype, const double anc_lnp, const double open_lnp) const {
+    const auto s = genotype.count() + 1u;
+    const double ln_w = ln_w_gene_[j];
+    if (ln_w == -std::numeric_limits<double>::infinity()) return;
+    const size_t sig = gene_sig_[j];
+    double lnp = anc_lnp;
+    lnp += ln_w;
+    lnp -= open_lnp;
+    lnp += ws.ln_theta_terms[term_index(pathtype, sig)];
+    subtree->ln_denoms[s].push(lnp);
+    if (s < max_sites) {
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+        if (prune(subtree, s, lnp)) return;
+        mutate(ws, subtree, GeneBits(genotype).set(j), next_pathtype(pathtype, sig), lnp, sub_lnp(open_lnp, ln_w));
+    }
+}
+
+// The probabilities of the next genes sum to one,
+// so the descendants at depth s + d sum to at most exp(lnp) * max_term^d.
+// The subtree is skipped if the bounds added to those skipped so far
+// stay within the budget at all depths.
+template <class PathBits>
+bool GenotypeModel::DatasetImpl<PathBits>::prune(Subtree* subtree, const size_t s, const double lnp) const {
+    if (subtree->ln_budget == -std::numeric_limits<double>::infinity()) return false;
+    auto& floors = subtree->ln_floors;
+    auto& skipped = subtree->ln_skipped;
+    floors[s] = std::max(floors[s], lnp);
+    for (size_t d=1u; s + d <= max_sites; ++d) {
+        const double bound = lnp + static_cast<double>(d) * subtree->ln_max_term;
+        // cheap test before the sum
+        if (bound >= subtree->ln_budget + floors[s + d]) return false;
+    }
+    for (size_t d=1u; s + d <= max_sites; ++d) {
+        const double bound = lnp + static_cast<double>(d) * subtree->ln_max_term;
+        if (add_lnp(skipped[s + d], bound) >= subtree->ln_budget + floors[s + d]) return false;
+    }
+    for (size_t d=1u; s + d <= max_sites; ++d) {
+        skipped[s + d] = add_lnp(skipped[s + d], lnp + static_cast<double>(d) * subtree->ln_max_term);
+    }
+    return true;
+}
+
+// Multisets of gene classes are enumerated as sorted tuples a[0] <= ... < a[s-1]
+// in colex order of the strictly increasing b[i] = a[i] + i,
+// so that rank(b) = sum_i binom(b[i], i + 1).
+// f[rank] is the sum of probabilities of mutation paths ending in the multiset.
+// States in a level are independent and evaluated in fixed chunks.
+// df[rank * num_params + k] is the sum weighted by the exponent of theta_k.
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::calc_denoms_dp(Workspace* ws) const {
+    constexpr size_t chunk_size = 1024u;
+    const size_t num_classes = gene_classes_.size();
+    const size_t num_params = ws->gradient ? ws->ln_theta.size() : 0u;
+    std::vector<double> prev_f(1u, 1.0);
+    std::vector<double> f;
+    std::vector<double> prev_df(num_params, 0.0);
+    std::vector<double> df;
+    if (ws->gradient) {
+        ws->dln_denoms.assign(max_sites + 1u, std::valarray<double>(0.0, num_params));
+    }
+    for (size_t s=1u; s<=max_sites; ++s) {
+        f.assign(binom_[num_classes + s - 1u][s], 0.0);
+        df.assign(f.size() * num_params, 0.0);
+        const size_t num_chunks = (f.size() + chunk_size - 1u) / chunk_size;
+        parallel_for(num_chunks, ws->concurrency, [&](const size_t chunk) {
+            const size_t end = std::min((chunk + 1u) * chunk_size, f.size());
+            calc_dp_states(*ws, s, chunk * chunk_size, end, prev_f, &f, prev_df, &df);
+        });
+        const double denom = std::accumulate(f.begin(), f.end(), 0.0);
+        ws->ln_denoms[s] = std::log(denom);
+        if (ws->gradient) {
+            auto& dln_denom = ws->dln_denoms[s];
+            for (size_t rank=0u; rank<f.size(); ++rank) {
+                for (size_t k=0u; k<num_params; ++k) {
+                    dln_denom[k] += df[rank * num_params + k];
+                }
+            }
+            dln_denom /= denom;
+        }
+        prev_f.swap(f);
+        prev_df.swap(df);
+    }
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::calc_dp_states(
+  const Workspace& ws, const size_t s, const size_t begin, const size_t end,
+  const std::vector<double>& prev_f, std::vector<double>* f,
+  const std::vector<double>& prev_df, std::vector<double>* df) const {
+    const size_t max_b = gene_classes_.size() + s - 1u;
+    const size_t num_params = ws.gradient ? ws.ln_theta.size() : 0u;
+    std::vector<size_t> b(s);
+    std::vector<size_t> a(s);
+    std::vector<double> dp(num_params);
+    unrank_combination(begin, max_b, &b);
+    for (size_t rank=begin; rank<end; ++rank) {
+        for (size_t i=0u; i<s; ++i) {a[i] = b[i] - i;}
+        double p = 0.0;
+        std::fill(dp.begin(), dp.end(), 0.0);
+        for (size_t i=0u, first=0u; i<s; ++i) {
+            if (i + 1u < s && a[i + 1u] == a[i]) continue;
+            // remove the last occurrence of class a[i] at position i
+            const GeneClass& mut_class = gene_classes_[a[i]];
+            const size_t count = i - first + 1u;
+            first = i + 1u;
+            if (count > mut_class.size) {
+                p = 0.0;
+                std::fill(dp.begin(), dp.end(), 0.0);
+                break;
+            }
+            size_t prev_rank = 0u;
+            double prev_w = 0.0;
+            size_t pathtype = 0u;
+            for (size_t j=0u; j<s; ++j) {
+                if (j == i) continue;
+                prev_rank += (j < i) ? binom_[b[j]][j + 1u] : binom_[b[j] - 1u][j];
+                prev_w += gene_classes_[a[j]].w;
+                pathtype = next_pathtype(pathtype, gene_classes_[a[j]].sig);
+            }
+            const size_t idx = term_index(pathtype, mut_class.sig);
+            const double factor = (mut_class.size - count + 1u) * mut_class.w
+                                  / (1.0 - prev_w) * ws.theta_terms[idx];
+            p += prev_f[prev_rank] * factor;
+            if (ws.gradient) {
+                const double* src = &prev_df[prev_rank * num_params];
+                for (size_t k=0u; k<num_params; ++k) {dp[k] += src[k] * factor;}
+                add_term_params(ws, idx, prev_f[prev_rank] * factor, dp.data());
+            }
+        }
+        (*f)[rank] = p;
+        std::copy(dp.begin(), dp.end(), df->begin() + rank * num_params);
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+        next_combination(&b, max_b);
+    }
+}
+
+template <class PathBits>
+void GenotypeModel::DatasetImpl<PathBits>::unrank_combination(
+  const size_t rank, const size_t max_b, std::vector<size_t>* b) const {
+    for (size_t i=b->size(), rest=rank, upper=max_b; i-- > 0u;) {
+        size_t x = upper - 1u;
+        while (binom_[x][i + 1u] > rest) --x;
+        (*b)[i] = x;
+        rest -= binom_[x][i + 1u];
+        upper = x;
+    }
+}
+
+// The states and transitions are enumerated once for all theta in the batch,
+// and the innermost loops run over contiguous theta to be vectorized.
+template <class PathBits> template <class T>
+std::vector<double> GenotypeModel::DatasetImpl<PathBits>::calc_loglik_batch(
+  const GenotypeModel& model, const std::vector<std::valarray<double>>& thetas,
+  const unsigned int concurrency) const {
+    std::vector<double> logliks;
+    logliks.reserve(thetas.size());
+    if (model.engine_ != Engine::dp) {
+        for (const auto& theta: thetas) {
+            logliks.push_back(calc_loglik(model, theta, concurrency, nullptr, nullptr));
+        }
+        return logliks;
+    }
+    const size_t batch = thetas.size();
+    const auto ws = init_batch<T>(model, thetas, concurrency);
+    const auto sum_lnp = sum_lnp_samples_batch(ws);
+    const auto ln_denoms = calc_denoms_dp_batch(ws);
+    for (size_t i=0u; i<batch; ++i) {
+        double loglik = lnp_const_;
+        loglik += sum_lnp[i];
+        for (size_t s=2u; s<=max_sites; ++s) {
+            loglik -= nsam_with_s[s] * ln_denoms[s * batch + i];
+        }
+        logliks.push_back(loglik);
+    }
+    return logliks;
+}
+
+template <class PathBits> template <class T>
+GenotypeModel::DatasetImpl<PathBits>::BatchWorkspace<T>
+GenotypeModel::DatasetImpl<PathBits>::init_batch(
+  const GenotypeModel& model, const std::vector<std::valarray<double>>& thetas,
+  const unsigned int concurrency) const {
+    const size_t batch = thetas.size();
+    BatchWorkspace<T> ws{batch, concurrency, {}};
+    ws.theta_terms.resize(pathtypes_.size() * signatures_.size() * batch);
+    for (size_t i=0u; i<batch; ++i) {
+        Workspace single(model, thetas[i], concurrency, false);
+        init_theta_terms(&single);
+        for (size_t idx=0u; idx<single.theta_terms.size(); ++idx) {
+            ws.theta_terms[idx * batch + i] = static_cast<T>(single.theta_terms[idx]);
+        }
+    }
+    return ws;
+}
+
+// The nodes are evaluated as a batch, or one by one by the recursion.
+template <class PathBits>
+AxisLoglik GenotypeModel::DatasetImpl<PathBits>::calc_axis(
+  const GenotypeModel& model, const std::valarray<double>& theta, const size_t k,
+  const double lower, const double upper, const unsigned int concurrency) const {
+    if (!(lower < upper)) throw std::runtime_error("empty interval for calc_axis");
+    const size_t n = max_sites + 1u;
+    AxisLoglik axis;
+    axis.constant = lnp_const_;
+    std::vector<std::valarray<double>> thetas(n, theta);
+    const double pi = std::acos(-1.0);
+    for (size_t j=0u; j<n; ++j) {
+        // Chebyshev points of the first kind
+        const double angle = (2.0 * j + 1.0) * pi / (2.0 * n);
+        axis.nodes.push_back(0.5 * (lower + upper) + 0.5 * (upper - lower) * std::cos(angle));
+        axis.weights.push_back(((j % 2u) ? -1.0 : 1.0) * std::sin(angle));
+        thetas[j][k] = axis.nodes[j];
+    }
+    const auto ws = init_batch<double>(model, thetas, concurrency);
+    const size_t num_sigtypes = sigtypes_.size();
+    axis.values.resize((num_sigtypes + max_sites - 1u) * n);
+    parallel_for(num_sigtypes, concurrency, [&](const size_t i) {
+        double* values = &axis.values[i * n];
+        lnp_sample_batch(ws, sigtypes_[i].first, values);
+        for (size_t j=0u; j<n; ++j) {values[j] = std::exp(values[j]);}
+    });
+    for (const auto& sigtype: sigtypes_) {
+        axis.coefs.push_back(static_cast<double>(sigtype.second));
+    }
+    std::vector<double> ln_denoms;
+    if (model.engine_ == Engine::dp) {
+        ln_denoms = calc_denoms_dp_batch(ws);
+    } else {
+        ln_denoms.resize((max_sites + 1u) * n);
+        for (size_t j=0u; j<n; ++j) {
+            Workspace single(model, thetas[j], concurrency, false);
+            init_theta_terms(&single);
+            single.ln_denoms.resize(max_sites + 1u);
+            single.ln_denoms = -std::numeric_limits<double>::infinity();
+            calc_denoms_recursion(&single);
+            for (size_t s=0u; s<=max_sites; ++s) {ln_denoms[s * n + j] = single.ln_denoms[s];}
+        }
+    }
+    for (size_t s=2u; s<=max_sites; ++s) {
+        double* values = &axis.values[(num_sigtypes + s - 2u) * n];
+        for (size_t j=0u; j<n; ++j) {values[j] = std::exp(ln_denoms[s * n + j]);}
+        axis.coefs.push_back(-static_cast<double>(nsam_with_s[s]));
+    }
+    return axis;
+}
+
+double AxisLoglik::operator()(const double x) const {
+    const size_t n = nodes.size();
+    std::vector<double> u(n);
+    double norm = 0.0;
+    size_t exact = -1u;
+    for (size_t j=0u; j<n; ++j) {
+        if (x == nodes[j]) {
+            exact = j;
+            break;
+        }
+        u[j] = weights[j] / (x - nodes[j]);
+        norm += u[j];
+    }
+    double loglik = constant;
+    for (size_t i=0u; i<coefs.size(); ++i) {
+        const double* f = &values[i * n];
+        double y = 0.0;
+        if (exact != -1u) {
+            y = f[exact];
+        } else {
+            for (size_t j=0u; j<n; ++j) {y += u[j] * f[j];}
+            y /= norm;
+        }
+        loglik += coefs[i] * std::log(y);
+    }
+    return loglik;
+}
+
+// Chunks are the same as in sum_lnp_samples() to sum in the same order.
+template <class PathBits> template <class T>
+std::vector<double> GenotypeModel::DatasetImpl<PathBits>::sum_lnp_samples_batch(const BatchWorkspace<T>& ws) const {
+    constexpr size_t chunk_size = 64u;
+    const size_t batch = ws.batch;
+    const size_t num_chunks = (sigtypes_.size() + chunk_size - 1u) / chunk_size;
+    std::vector<double> partial_sums(num_chunks * batch, 0.0);
+    parallel_for(num_chunks, ws.concurrency, [&](const size_t chunk) {
+        const size_t end = std::min((chunk + 1u) * chunk_size, sigtypes_.size());
+        std::vector<double> lnp(batch);
+        double* sums = &partial_sums[chunk * batch];
+        for (size_t i=chunk * chunk_size; i<end; ++i) {
+            const double n = static_cast<double>(sigtypes_[i].second);
+            lnp_sample_batch(ws, sigtypes_[i].first, lnp.data());
+            for (size_t k=0u; k<batch; ++k) {sums[k] += n * lnp[k];}
+        }
+    });
+    std::vector<double> sum_lnp(batch, 0.0);
+    for (size_t chunk=0u; chunk<num_chunks; ++chunk) {
+        for (size_t k=0u; k<batch; ++k) {sum_lnp[k] += partial_sums[chunk * batch + k];}
+    }
+    return sum_lnp;
+}
+
+template <class PathBits> template <class T>
+void GenotypeModel::DatasetImpl<PathBits>::lnp_sample_batch(
+  const BatchWorkspace<T>& ws, const std::vector<size_t>& genotype, double* lnp) const {
+    const size_t batch = ws.batch;
+    const size_t s = genotype.size();
+    const size_t num_subsets = size_t(1u) << s;
+    std::vector<T> g(num_subsets * batch, T(0));
+    std::vector<size_t> pathtypes(num_subsets, 0u);
+    std::fill(g.begin(), g.begin() + batch, T(1));
+    for (size_t subset=1u; subset<num_subsets; ++subset) {
+        if (subset + 1u < num_subsets) {
+            const size_t low = static_cast<size_t>(__builtin_ctzll(subset));
+            pathtypes[subset] = next_pathtype(pathtypes[subset ^ (size_t(1u) << low)], gene_sig_[genotype[low]]);
+        }
+        T* p = &g[subset * batch];
+        for (size_t i=0u; i<s; ++i) {
+            const size_t bit = size_t(1u) << i;
+            if ((subset & bit) == 0u) continue;
+            const size_t prev = subset ^ bit;
+            const T* t = &ws.theta_terms[term_index(pathtypes[prev], gene_sig_[genotype[i]]) * batch];
+            const T* prev_g = &g[prev * batch];
+            for (size_t k=0u; k<batch; ++k) {p[k] += prev_g[k] * t[k];}
+        }
+    }
+    for (size_t k=0u; k<batch; ++k) {
+        lnp[k] = std::log(static_cast<double>(g[(num_subsets - 1u) * batch + k]));
+    }
+}
+
+template <class PathBits> template <class T>
+std::vector<double> GenotypeModel::DatasetImpl<PathBits>::calc_denoms_dp_batch(const BatchWorkspace<T>& ws) const {
+    constexpr size_t chunk_size = 1024u;
+    const size_t batch = ws.batch;
+    const size_t num_classes = gene_classes_.size();
+    std::vector<double> ln_denoms((max_sites + 1u) * batch, -std::numeric_limits<double>::infinity());
+    std::vector<T> prev_f(batch, T(1));
+    std::vector<T> f;
+    std::vector<double> denoms(batch);
+    for (size_t s=1u; s<=max_sites; ++s) {
+        const size_t num_states = binom_[num_classes + s - 1u][s];
+        f.assign(num_states * batch, T(0));
+        const size_t num_chunks = (num_states + chunk_size - 1u) / chunk_size;
+        parallel_for(num_chunks, ws.concurrency, [&](const size_t chunk) {
+            const size_t end = std::min((chunk + 1u) * chunk_size, num_states);
+            calc_dp_states_batch(ws, s, chunk * chunk_size, end, prev_f, &f);
+        });
+        std::fill(denoms.begin(), denoms.end(), 0.0);
+        for (size_t rank=0u; rank<num_states; ++rank) {
+            for (size_t k=0u; k<batch; ++k) {denoms[k] += f[rank * batch + k];}
+        }
+        for (size_t k=0u; k<batch; ++k) {
+            ln_denoms[s * batch + k] = std::log(denoms[k]);
+        }
+        prev_f.swap(f);
+    }
+    return ln_denoms;
+}
+
+template <class PathBits> template <class T>
+void GenotypeModel::DatasetImpl<PathBits>::calc_dp_states_batch(
+  const BatchWorkspace<T>& ws, const size_t s, const size_t begin, const size_t end,
+  const std::vector<T>& prev_f, std::vector<T>* f) const {
+    const size_t batch = ws.batch;
+    const size_t max_b = gene_classes_.size() + s - 1u;
+    std::vector<size_t> b(s);
+    std::vector<size_t> a(s);
+    unrank_combination(begin, max_b, &b);
+    for (size_t rank=begin; rank<end; ++rank) {
+        for (size_t i=0u; i<s; ++i) {a[i] = b[i] - i;}
+        T* p = &(*f)[rank * batch];
+        for (size_t i=0u, first=0u; i<s; ++i) {
+            if (i + 1u < s && a[i + 1u] == a[i]) continue;
+            const GeneClass& mut_class = gene_classes_[a[i]];
+            const size_t count = i - first + 1u;
+            first = i + 1u;
+            if (count > mut_class.size) {
+                std::fill(p, p + batch, T(0));
+                break;
+            }
+            size_t prev_rank = 0u;
+            double prev_w = 0.0;
+            size_t pathtype = 0u;
+            for (size_t j=0u; j<s; ++j) {
+                if (j == i) continue;
+                prev_rank += (j < i) ? binom_[b[j]][j + 1u] : binom_[b[j] - 1u][j];
+                prev_w += gene_classes_[a[j]].w;
+                pathtype = next_pathtype(pathtype, gene_classes_[a[j]].sig);
+            }
+            const T coef = static_cast<T>((mut_class.size - count + 1u) * mut_class.w / (1.0 - prev_w));
+            const T* t = &ws.theta_terms[term_index(pathtype, mut_class.sig) * batch];
+            const T* src = &prev_f[prev_rank * batch];
+            for (size_t k=0u; k<batch; ++k) {p[k] += src[k] * (coef * t[k]);}
+        }
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+        next_combination(&b, max_b);
+    }
+}
+
+void GenotypeModel::benchmark(const size_t n) const {
+    const std::valarray<double> param(0.9, names_.size());
+    double leaves = wtl::pow(static_cast<double>(data_->num_genes), static_cast<unsigned int>(data_->max_sites));
+    std::cerr << "# parameters: " << names_.size() << std::endl;
+    std::cerr << "width: " << data_->num_genes << std::endl;
+    std::cerr << "depth: " << data_->max_sites << std::endl;
     std::cerr << "w ^ d: " << leaves * 1e-6 << " M" <<std::endl;
-    wtl::benchmark([&param,this]() {calc_loglik(param);}, "", n);
+    std::cerr << "dp states: " << data_->max_dp_states * 1e-6 << " M" << std::endl;
+    if (dp_bytes() <= memory_limit()) {
+        auto dp = *this;
+        dp.set_engine(Engine::dp);
+        std::cerr << "dp: " << dp.calc_loglik(param) << std::endl;
+        wtl::benchmark([&param,&dp]() {dp.calc_loglik(param);}, "", n);
+    }
+    auto reference = *this;
+    reference.set_engine(Engine::recursion);
+    std::cerr << "recursion (" << sum_exp_isa() << "): " << reference.calc_loglik(param) << std::endl;
+    wtl::benchmark([&param,&reference]() {reference.calc_loglik(param);}, "", n);
+    reference.set_pruning(1e-9);
+    double skipped = 0.0;
+    std::cerr << "pruned: " << reference.calc_loglik_and_skipped(param, &skipped)
+              << " (skipped " << skipped << ")" << std::endl;
+    wtl::benchmark([&param,&reference]() {reference.calc_loglik(param);}, "", n);
 }
 
 } // namespace likeligrid
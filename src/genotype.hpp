@@ -5,110 +5,174 @@
 #ifndef LIKELIGRID_GENOTYPE_HPP_
 #define LIKELIGRID_GENOTYPE_HPP_
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <valarray>
-#include <bitset>
+#include <memory>
 
 namespace likeligrid {
 
-using bits_t = std::bitset<128>;
+/*! @brief Loglik along an axis of theta with the other parameters fixed
 
+    Each sample term and each denominator is a polynomial in theta[k]
+    of degree at most max_sites, as a mutation multiplies theta[k] at most once.
+    They are evaluated at Chebyshev nodes and interpolated in barycentric form,
+    so that each point costs O(max_sites) per sample.
+*/
+class AxisLoglik {
+  public:
+    //! Exact up to rounding in the interval given to GenotypeModel::calc_axis()
+    double operator()(double x) const;
+
+    std::vector<double> nodes;
+    std::vector<double> weights;
+    //! values of term i at node j in [i * nodes.size() + j]
+    std::vector<double> values;
+    //! loglik = constant + sum_i coefs[i] * log(term_i)
+    std::vector<double> coefs;
+    double constant = 0.0;
+};
+
+/*! @brief Likelihood model of mutated genes
+
+    Copies share the immutable dataset, and calc_loglik() is const,
+    so that a single instance can be evaluated from multiple threads.
+*/
 class GenotypeModel {
   public:
-    GenotypeModel(std::istream& ist, size_t max_sites) {
-        init(ist, max_sites);
-    }
+    //! Algorithms to calculate the denominators
+    enum class Engine {
+        dp,        //!< dynamic programming over multisets and subsets of genes
+        recursion  //!< exhaustive enumeration of mutation paths (reference)
+    };
+
+    GenotypeModel(std::istream& ist, size_t max_sites)
+    : data_(load(ist, max_sites)),
+      names_(data_->names) {init_engine();}
     GenotypeModel(std::istream&& ist, size_t max_sites)
     : GenotypeModel(ist, max_sites) {}
     GenotypeModel(const std::string&, size_t max_sites);
 
     bool set_epistasis(const std::pair<size_t, size_t>& pair, bool pleiotropy=false);
 
-    double calc_loglik(const std::valarray<double>& theta);
-    void benchmark(size_t);
+    //! Evaluate with `concurrency` threads; the result does not depend on it
+    double calc_loglik(const std::valarray<double>& theta, unsigned int concurrency=1u) const {
+        return data_->calc_loglik(*this, theta, concurrency, nullptr, nullptr);
+    }
+    //! Evaluate a batch of theta in a single pass over the states;
+    //! the results are identical to those of calc_loglik()
+    std::vector<double> calc_loglik_batch(const std::vector<std::valarray<double>>& thetas,
+                                          unsigned int concurrency=1u) const {
+        return data_->calc_loglik_batch(*this, thetas, concurrency);
+    }
+    //! Single-precision calc_loglik_batch() to rank theta;
+    //! the error grows with the number of samples and states
+    std::vector<double> approx_loglik_batch(const std::vector<std::valarray<double>>& thetas,
+                                            unsigned int concurrency=1u) const {
+        return data_->approx_loglik_batch(*this, thetas, concurrency);
+    }
+    //! Evaluate d loglik / d theta as well; only with Engine::dp
+    double calc_loglik_and_gradient(const std::valarray<double>& theta,
+                                    std::valarray<double>* gradient,
+                                    unsigned int concurrency=1u) const {
+        return data_->calc_loglik(*this, theta, concurrency, gradient, nullptr);
+    }
+    //! `skipped` receives an upper bound of the mass skipped by set_pruning(),
+    //! relative to the denominator; the max over the number of mutations,
+    //! which does not exceed the tolerance
+    double calc_loglik_and_skipped(const std::valarray<double>& theta, double* skipped,
+                                   unsigned int concurrency=1u) const {
+        return data_->calc_loglik(*this, theta, concurrency, nullptr, skipped);
+    }
+    //! Prepare AxisLoglik for theta[k] in [lower, upper]
+    AxisLoglik calc_axis(const std::valarray<double>& theta, size_t k,
+                         double lower, double upper, unsigned int concurrency=1u) const {
+        return data_->calc_axis(*this, theta, k, lower, upper, concurrency);
+    }
+    void benchmark(size_t) const;
+
+    //! Engine::dp is chosen at construction unless dp_bytes() exceeds memory_limit()
+    void set_engine(Engine engine) {engine_ = engine;}
+    /*! @brief Skip subtrees of Engine::recursion; 0 to disable
+
+        The mass skipped at each number of mutations is at most `tolerance`
+        relative to its denominator, so that loglik rises by at most
+        -log(1 - tolerance) per sample.
+        Engine::dp, which GridSearch and GradientDescent use, has no subtrees
+        to skip; it is exact and ignores the tolerance.
+    */
+    void set_pruning(double tolerance) {pruning_ = tolerance;}
 
     // getter
-    const std::string& filename() const {return filename_;}
+    const std::string& filename() const {return data_->filename;}
     const std::vector<std::string>& names() const {return names_;}
     const std::pair<size_t, size_t>& epistasis_pair() const {return epistasis_pair_;}
-    size_t max_sites() const {return max_sites_;}
-
-  private:
-    void init(std::istream&, size_t max_sites);
-
-    double lnp_sample(const bits_t& genotype) const;
-
-    void mutate(const bits_t& genotype=bits_t(), const bits_t& pathtype=bits_t(),
-                double anc_lnp=0.0, double open_lnp=0.0);
-
-    double ln_theta_if_subset(const bits_t& pathtype, const bits_t& mut_path) const {
-        double lnp = 0.0;
-        for (size_t i=0u; i<num_pathways_; ++i) {
-            if (mut_path[i]) {
-                if (pathtype[i]) {
-                    lnp += ln_theta_[i];
-                } else {
-                    return 0.0;
-                }
-            }
-        }
-        return lnp;
-    }
-
-    double ln_theta_if_paired(const bits_t& pathtype, const bits_t& mut_path) const {
-        if (pathtype[epistasis_pair_.first]) {
-            if (pathtype[epistasis_pair_.second]) return 0.0;
-            if (mut_path[epistasis_pair_.second]) return ln_theta_[epistasis_idx_];
-        }
-        if (pathtype[epistasis_pair_.second]) {
-            if (mut_path[epistasis_pair_.first]) return ln_theta_[epistasis_idx_];
-        }
-        if (mut_path[epistasis_pair_.first]) {
-            if (mut_path[epistasis_pair_.second]) return ln_theta_[pleiotropy_idx_];
-        }
-        return 0.0;
-    }
-
-    double sum_ln_theta(const std::valarray<size_t>& mut_route) const {
-        double lnp = 0.0;
-        bits_t pathtype;
-        for (const auto j: mut_route) {
-            const auto& mut_path = effects_[j];
-            lnp += ln_theta_if_subset(pathtype, mut_path);
-            if (epistasis_) {lnp += ln_theta_if_paired(pathtype, mut_path);}
-            pathtype |= mut_path;
-        }
-        return lnp;
+    size_t max_sites() const {return data_->max_sites;}
+    Engine engine() const {return engine_;}
+    //! Bytes of the two DP levels held at once with `width` doubles per state,
+    //! i.e., the batch size, or 1 + the number of parameters with gradient
+    double dp_bytes(size_t width=1u) const {
+        return data_->max_dp_states * static_cast<double>(width * sizeof(double));
     }
+    //! Half of the physical memory
+    static double memory_limit();
+    //! Identify the samples and settings that determine loglik
+    std::string fingerprint() const;
 
-    bits_t translate(size_t mut_idx) const {
-        bits_t mut_path;
-        for (size_t j=0u; j<num_pathways_; ++j) {
-            mut_path.set(j, annot_[j][mut_idx]);
-        }
-        return mut_path;
-    }
+  private:
+    /*! @brief Immutable data loaded once and shared by copies of the model
+
+        Implemented in DatasetImpl for the width of pathway bit-sets
+        selected by the number of pathways at load time.
+    */
+    class Dataset {
+      public:
+        virtual ~Dataset() = default;
+        virtual double calc_loglik(const GenotypeModel& model,
+                                   const std::valarray<double>& theta,
+                                   unsigned int concurrency,
+                                   std::valarray<double>* gradient,
+                                   double* skipped) const = 0;
+        virtual std::vector<double> calc_loglik_batch(const GenotypeModel& model,
+                                                      const std::vector<std::valarray<double>>& thetas,
+                                                      unsigned int concurrency) const = 0;
+        virtual std::vector<double> approx_loglik_batch(const GenotypeModel& model,
+                                                        const std::vector<std::valarray<double>>& thetas,
+                                                        unsigned int concurrency) const = 0;
+        virtual AxisLoglik calc_axis(const GenotypeModel& model,
+                                     const std::valarray<double>& theta, size_t k,
+                                     double lower, double upper,
+                                     unsigned int concurrency) const = 0;
+
+        std::string filename = "-";
+        std::vector<std::string> names;
+        size_t num_pathways;
+        size_t num_genes;
+        std::vector<size_t> nsam_with_s;
+        size_t max_sites;
+        //! states in the largest pair of consecutive DP levels
+        double max_dp_states = 0.0;
+        //! hash of pathways, annotation, and samples
+        uint64_t digest = 14695981039346656037ull;
+    };
+    template <class PathBits> class DatasetImpl;
+
+    static std::shared_ptr<const Dataset>
+    load(std::istream&, size_t max_sites, const std::string& filename="-");
+    void init_engine();
 
     // initialized in constructor
-    std::string filename_ = "-";
+    std::shared_ptr<const Dataset> data_;
     std::vector<std::string> names_;
-    size_t num_pathways_;
-    std::vector<bits_t> annot_;
-    std::vector<bits_t> genot_;
-    std::valarray<double> ln_w_gene_;
-    size_t num_genes_;
-    std::vector<size_t> nsam_with_s_;
-    size_t max_sites_;
-    std::vector<bits_t> effects_;
-
-    // updated in calc_loglik()
-    std::valarray<double> ln_theta_;
-    std::valarray<double> ln_denoms_;
+
+    // set before calc_loglik()
     std::pair<size_t, size_t> epistasis_pair_;
     bool epistasis_ = false;
     size_t epistasis_idx_ = -1u;
     size_t pleiotropy_idx_ = epistasis_idx_;
+    Engine engine_ = Engine::dp;
+    double pruning_ = 0.0;
 };
 
 } // namespace likeligrid
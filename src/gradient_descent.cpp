@@ -4,24 +4,43 @@
 #include "gradient_descent.hpp"
 #include "genotype.hpp"
 #include "util.hpp"
+#include "lbfgs.hpp"
+#include "columnar.hpp"
+#include "cache.hpp"
 
 #include <sfmt.hpp>
 #include <wtl/exception.hpp>
 #include <wtl/debug.hpp>
 #include <wtl/iostr.hpp>
 #include <wtl/zlib.hpp>
-#include <wtl/itertools.hpp>
 #include <wtl/concurrent.hpp>
 #include <wtl/scope.hpp>
 #include <wtl/filesystem.hpp>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+
 namespace likeligrid {
 
 namespace fs = wtl::filesystem;
 
-// std::unique_ptr needs to know GenotypeModel implementation
+// std::unique_ptr needs to know LoglikCache implementation
 GradientDescent::~GradientDescent() = default;
 
+void GradientDescent::set_cache(const std::string& dir) {HERE;
+    cache_ = std::make_unique<LoglikCache>(dir, model_->fingerprint(), model_->names().size());
+}
+
+double GradientDescent::calc_loglik(const std::valarray<double>& theta) {
+    double loglik;
+    if (cache_ && cache_->find(theta, &loglik)) return loglik;
+    loglik = model_->calc_loglik(theta, concurrency_);
+    if (cache_) cache_->insert(theta, loglik);
+    return loglik;
+}
+
 GradientDescent::GradientDescent(
     std::istream& ist,
     const size_t max_sites,
@@ -32,6 +51,7 @@ GradientDescent::GradientDescent(
       concurrency_(concurrency)
     {HERE;
     model_->set_epistasis(epistasis_pair, pleiotropy);
+    history_ = LatticeTable(model_->names().size());
 }
 
 GradientDescent::GradientDescent(
@@ -44,41 +64,95 @@ GradientDescent::GradientDescent(
     {HERE;
 
     std::string genotype_file = infile;
-    if (wtl::endswith(infile, ".tsv.gz")) {// previous result
-        wtl::zlib::ifstream ist(infile);
+    if (wtl::endswith(infile, ".tsv.gz") || wtl::endswith(infile, ".bin")) {// previous result
         size_t prev_max_sites;
-        std::tie(genotype_file, prev_max_sites, std::ignore, std::ignore) = read_metadata(ist);
-        std::tie(std::ignore, std::ignore, starting_point_) = read_body(ist);
+        if (is_columnar(infile)) {
+            const auto checkpoint = read_checkpoint(infile);
+            if (checkpoint.valid_size == 0u) throw std::runtime_error("incomplete binary result file: " + infile);
+            std::istringstream iss(checkpoint.header);
+            std::tie(genotype_file, prev_max_sites, std::ignore, std::ignore) = read_metadata(iss);
+            starting_point_ = checkpoint.mle_params;
+        } else {
+            wtl::zlib::ifstream ist(infile);
+            std::tie(genotype_file, prev_max_sites, std::ignore, std::ignore) = read_metadata(ist);
+            std::tie(std::ignore, std::ignore, starting_point_, std::ignore) = read_body(ist);
+        }
         std::string prev_filename = fs::path(infile).filename();
+        if (wtl::endswith(prev_filename, ".bin")) {
+            prev_filename.replace(prev_filename.size() - 4u, 4u, ".tsv.gz");
+        }
         std::ostringstream oss;
-        oss << "grad-from-s" << prev_max_sites << "-" << prev_filename;
+        oss << "from-s" << prev_max_sites << "-" << prev_filename;
         outfile_ = oss.str();
     } else {
-        outfile_ = "grad-from-center.tsv.gz";
+        outfile_ = "from-center.tsv.gz";
     }
     model_ = std::make_unique<GenotypeModel>(genotype_file, max_sites);
     model_->set_epistasis(epistasis_pair, pleiotropy);
+    history_ = LatticeTable(model_->names().size());
+}
+
+GradientDescent::GradientDescent(
+    const GenotypeModel& model,
+    const std::pair<size_t, size_t>& epistasis_pair,
+    const bool pleiotropy,
+    const unsigned int concurrency)
+    : model_(std::make_unique<GenotypeModel>(model)),
+      outfile_("from-center.tsv.gz"),
+      concurrency_(concurrency)
+    {HERE;
+    model_->set_epistasis(epistasis_pair, pleiotropy);
+    history_ = LatticeTable(model_->names().size());
 }
 
 void GradientDescent::run(std::ostream& ost) {HERE;
     auto at_exit = wtl::scope_exit([&ost,this](){
-        std::cerr << "\n" << *const_max_iterator() << std::endl;
+        std::cerr << "\n" << max_point() << std::endl;
         write(ost);
     });
 
     std::valarray<double> new_start(1.0, model_->names().size());
     std::copy(std::begin(starting_point_), std::end(starting_point_), std::begin(new_start));
-    history_.emplace(new_start, model_->calc_loglik(new_start));
-    std::cerr << "start: " << *history_.begin() << std::endl;
+    if (method_ == Method::lbfgs) {
+        run_lbfgs(new_start);
+        return;
+    }
+    // the walk stays on the lattice
+    new_start = (new_start * 100.0).apply(std::round) / 100.0;
+    std::vector<int16_t> key(new_start.size());
+    encode_lattice(new_start, key.data());
+    const double loglik = calc_loglik(new_start);
+    std::cerr << "start: " << std::make_pair(new_start, loglik) << std::endl;
 
-    for (auto it = max_iterator();
-         it != history_.end();
-         it = find_better(it)) {
+    const size_t start_row = history_.emplace(key.data(), loglik).first;
+    if (asynchronous_) {
+        walk_async(start_row);
+        return;
     }
+    for (size_t row = start_row;
+         row != LatticeTable::npos;
+         row = find_better(row)) {
+    }
+}
+
+void GradientDescent::run_lbfgs(std::valarray<double> theta) {HERE;
+    const GenotypeModel& model = *model_;
+    const size_t n = theta.size();
+    ProjectedLbfgs optimizer(std::valarray<double>(0.01, n), std::valarray<double>(2.0, n));
+    auto negative_loglik = [&model,this](const std::valarray<double>& x, std::valarray<double>* grad) {
+        const double loglik = model.calc_loglik_and_gradient(x, grad, concurrency_);
+        record(x, loglik);
+        std::cerr << "." << std::flush;
+        *grad *= -1.0;
+        return -loglik;
+    };
+    optimizer.minimize(negative_loglik, &theta);
+    std::cerr << "\nL-BFGS iterations: " << optimizer.iterations() << std::endl;
 }
 
 struct less_loglik_or_tie_farther {
-    bool operator()(const MapGrid::value_type& x, const MapGrid::value_type& y) const {
+    bool operator()(const std::pair<std::valarray<double>, double>& x,
+                    const std::pair<std::valarray<double>, double>& y) const {
         if (wtl::approx(x.second, y.second)) {
             return d2_from_neutral(x.first) > d2_from_neutral(y.first);
         } else {
@@ -87,64 +161,239 @@ struct less_loglik_or_tie_farther {
     }
 };
 
-MapGrid::iterator GradientDescent::find_better(const MapGrid::iterator& prev_it) {
-    static wtl::ThreadPool pool(concurrency_);
-    auto task = [](GenotypeModel model, const std::valarray<double> theta) {
-        // arguments are copied for each thread
-        return std::make_pair(theta, model.calc_loglik(theta));
+inline wtl::ThreadPool& thread_pool(const unsigned int concurrency) {
+    static wtl::ThreadPool pool(concurrency);
+    return pool;
+}
+
+size_t GradientDescent::find_better(const size_t prev_row) {
+    auto& pool = thread_pool(concurrency_);
+    const GenotypeModel& model = *model_;
+    auto task = [&model](const std::valarray<double> theta, const unsigned int threads) {
+        // argument is copied for each thread; model is shared
+        return model.calc_loglik(theta, threads);
     };
-    std::vector<std::future<std::pair<std::valarray<double>, double>>> futures;
+    const size_t dimensions = history_.dimensions();
+    auto& engine = wtl::sfmt64();
+    LatticeNeighbors neighbors(history_.key(prev_row), dimensions, 200, engine);
+    std::vector<int16_t> key(dimensions);
+    std::vector<int16_t> batch_keys;
+    std::vector<std::valarray<double>> batch;
+    std::vector<std::future<double>> futures;
+    batch_keys.reserve(concurrency_ * dimensions);
+    batch.reserve(concurrency_);
     futures.reserve(concurrency_);
-    auto better_it = prev_it;
-    const auto candidates = empty_neighbors_of(prev_it->first);
-    for (const auto& theta: candidates) {
-        futures.push_back(pool.submit(task, *model_, theta));
-        if ((futures.size() == concurrency_) || (&theta == &candidates.back())) {
-            for (auto& ftr: futures) {
-                auto result_it = history_.insert(ftr.get()).first;
-                std::cerr << "." << std::flush;
-                if (less_loglik_or_tie_farther{}(*better_it, *result_it)) {
-                    better_it = result_it;
-                }
+    auto best = std::make_pair(history_.params(prev_row), history_.loglik(prev_row));
+    size_t better_row = prev_row;
+    auto compete = [&](const size_t row) {
+        auto challenger = std::make_pair(history_.params(row), history_.loglik(row));
+        if (less_loglik_or_tie_farther{}(best, challenger)) {
+            best.swap(challenger);
+            better_row = row;
+        }
+    };
+    bool exhausted = false;
+    while (!exhausted) {
+        batch_keys.clear();
+        batch.clear();
+        while (batch.size() < concurrency_) {
+            if (!neighbors.next(key.data())) {
+                exhausted = true;
+                break;
             }
-            if (better_it != prev_it) {
-                std::cerr << "*" << std::flush;
-                return better_it;
+            if (history_.find(key.data()) != LatticeTable::npos) continue;
+            auto theta = decode_lattice(key.data(), dimensions);
+            double loglik;
+            if (cache_ && cache_->find(theta, &loglik)) {
+                compete(history_.emplace(key.data(), loglik).first);
+                if (better_row != prev_row) {
+                    std::cerr << "*" << std::flush;
+                    return better_row;
+                }
+                continue;
             }
-            futures.clear();
+            batch_keys.insert(batch_keys.end(), key.begin(), key.end());
+            batch.push_back(std::move(theta));
+        }
+        if (batch.empty()) break;
+        // idle cores of a small batch are used inside each evaluation
+        const unsigned int threads = concurrency_ / static_cast<unsigned int>(batch.size());
+        futures.clear();
+        for (const auto& theta: batch) {
+            futures.push_back(pool.submit(task, theta, threads));
+        }
+        for (size_t i=0u; i<batch.size(); ++i) {
+            const double loglik = futures[i].get();
+            if (cache_) cache_->insert(batch[i], loglik);
+            compete(history_.emplace(batch_keys.data() + i * dimensions, loglik).first);
+            std::cerr << "." << std::flush;
+        }
+        if (cache_) cache_->flush();
+        if (better_row != prev_row) {
+            std::cerr << "*" << std::flush;
+            return better_row;
         }
     }
-    return history_.end();
+    return LatticeTable::npos;
 }
 
-std::vector<std::valarray<double>> GradientDescent::empty_neighbors_of(const std::valarray<double>& center) {
-    const auto axes = make_vicinity(center, 3, 0.01);
-    auto iter = wtl::itertools::product(axes);
-    std::vector<std::valarray<double>> empty_neighbors;
-    empty_neighbors.reserve(iter.max_count());
-    for (const auto& x: iter()) {
-        if (history_.find(x) == history_.end()) {
-            empty_neighbors.push_back(x);
+namespace {
+
+//! Result of an asynchronous evaluation
+struct Evaluation {
+    std::vector<int16_t> key;
+    std::valarray<double> theta;
+    double loglik;
+    //! false if cancelled before evaluation
+    bool evaluated;
+    std::exception_ptr error;
+};
+
+//! Evaluations in completion order
+class CompletionQueue {
+  public:
+    void push(Evaluation&& x) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push(std::move(x));
+        }
+        condition_.notify_one();
+    }
+    Evaluation pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this]{return !queue_.empty();});
+        Evaluation x = std::move(queue_.front());
+        queue_.pop();
+        return x;
+    }
+  private:
+    std::queue<Evaluation> queue_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+} // namespace
+
+// The pool is kept saturated with neighbors of the current best point,
+// and results are consumed in completion order.
+// A better result is accepted immediately from whichever neighborhood it came;
+// tasks queued for an older center are skipped without evaluation.
+void GradientDescent::walk_async(const size_t start_row) {HERE;
+    auto& pool = thread_pool(concurrency_);
+    const GenotypeModel& model = *model_;
+    const size_t dimensions = history_.dimensions();
+    CompletionQueue completed;
+    std::atomic<size_t> generation(0u);
+    auto task = [&model,&completed,&generation](std::vector<int16_t> key, std::valarray<double> theta,
+                                                const size_t submitted_generation) {
+        Evaluation result{std::move(key), std::move(theta), 0.0, false, nullptr};
+        if (submitted_generation == generation.load()) {
+            try {
+                result.loglik = model.calc_loglik(result.theta);
+                result.evaluated = true;
+            } catch (...) {
+                result.error = std::current_exception();
+            }
+        }
+        completed.push(std::move(result));
+    };
+    std::vector<std::vector<int16_t>> in_flight;
+    auto wait_one = [&]() {
+        Evaluation result = completed.pop();
+        in_flight.erase(std::find(in_flight.begin(), in_flight.end(), result.key));
+        return result;
+    };
+    auto drain = wtl::scope_exit([&](){
+        ++generation;
+        while (!in_flight.empty()) wait_one();
+    });
+
+    auto& engine = wtl::sfmt64();
+    size_t current = start_row;
+    auto best = std::make_pair(history_.params(current), history_.loglik(current));
+    auto neighbors = std::make_unique<LatticeNeighbors>(history_.key(current), dimensions, 200, engine);
+    bool exhausted = false;
+    auto compete = [&](const size_t row) {
+        auto challenger = std::make_pair(history_.params(row), history_.loglik(row));
+        if (!less_loglik_or_tie_farther{}(best, challenger)) return;
+        best.swap(challenger);
+        current = row;
+        ++generation;
+        neighbors = std::make_unique<LatticeNeighbors>(history_.key(current), dimensions, 200, engine);
+        exhausted = false;
+        if (cache_) cache_->flush();
+        std::cerr << "*" << std::flush;
+    };
+    const size_t max_in_flight = 2u * concurrency_;
+    std::vector<int16_t> key(dimensions);
+    while (true) {
+        while (!exhausted && in_flight.size() < max_in_flight) {
+            if (!neighbors->next(key.data())) {
+                exhausted = true;
+                break;
+            }
+            if (history_.find(key.data()) != LatticeTable::npos) continue;
+            if (std::find(in_flight.begin(), in_flight.end(), key) != in_flight.end()) continue;
+            auto theta = decode_lattice(key.data(), dimensions);
+            double loglik;
+            if (cache_ && cache_->find(theta, &loglik)) {
+                compete(history_.emplace(key.data(), loglik).first);
+                continue;
+            }
+            in_flight.push_back(key);
+            pool.submit(task, key, std::move(theta), generation.load());
         }
+        if (in_flight.empty()) break;
+        Evaluation result = wait_one();
+        if (result.error) std::rethrow_exception(result.error);
+        if (!result.evaluated) continue;
+        if (cache_) cache_->insert(result.theta, result.loglik);
+        std::cerr << "." << std::flush;
+        compete(history_.emplace(result.key.data(), result.loglik).first);
+    }
+    if (cache_) cache_->flush();
+}
+
+void GradientDescent::record(const std::valarray<double>& theta, const double loglik) {
+    std::vector<int16_t> key(theta.size());
+    if (theta.size() == history_.dimensions() && encode_lattice(theta, key.data())) {
+        history_.emplace(key.data(), loglik);
+    } else {
+        trace_.emplace_back(theta, loglik);
     }
-    std::shuffle(std::begin(empty_neighbors), std::end(empty_neighbors), wtl::sfmt64());
-    return empty_neighbors;
 }
 
 void GradientDescent::write(std::ostream& ost) {HERE;
     ost << "##genotype_file=" << model_->filename() << "\n";
     ost << "##max_sites=" << model_->max_sites() << "\n";
     ost << "##max_count=" << 0u << "\n";
-    ost << "##step=" << 0.01 << "\n";
+    ost << "##step=" << (method_ == Method::lbfgs ? 0.0 : 0.01) << "\n";
     ost << "loglik\t";
     wtl::join(model_->names(), ost, "\t") << "\n";
-    for (const auto& p: history_) {
+    for (size_t row=0u; row<history_.size(); ++row) {
+        ost << history_.loglik(row) << "\t";
+        wtl::join(history_.params(row), ost, "\t") << "\n";
+    }
+    for (const auto& p: trace_) {
         ost << p.second << "\t";
         wtl::join(p.first, ost, "\t") << "\n";
     }
 }
 
 std::tuple<std::string, size_t, std::string> GradientDescent::read_results(const std::string& infile) {HERE;
+    if (is_columnar(infile)) {
+        const ColumnarReader reader(infile);
+        std::istringstream iss(reader.header());
+        std::string genotype_file;
+        size_t prev_max_sites;
+        std::tie(genotype_file, prev_max_sites, std::ignore, std::ignore) = read_metadata(iss);
+        std::string epistasis_name = reader.colnames().back();
+        if (epistasis_name.find(':') == std::string::npos) epistasis_name.clear();
+        for (size_t i=0u; i<reader.num_rows(); ++i) {
+            record(reader.params(i), reader.loglik(i));
+        }
+        return std::tuple<std::string, size_t, std::string>{genotype_file, prev_max_sites, epistasis_name};
+    }
     wtl::zlib::ifstream ist(infile);
     std::string genotype_file;
     size_t prev_max_sites;
@@ -163,17 +412,21 @@ std::tuple<std::string, size_t, std::string> GradientDescent::read_results(const
         std::istream_iterator<double> it(iss);
         double loglik = *it;
         std::vector<double> vec(++it, std::istream_iterator<double>());
-        history_.emplace(std::valarray<double>(vec.data(), vec.size()), loglik);
+        record(std::valarray<double>(vec.data(), vec.size()), loglik);
     }
     return std::tuple<std::string, size_t, std::string>{genotype_file, prev_max_sites, epistasis_name};
 }
 
-MapGrid::iterator GradientDescent::max_iterator() {HERE;
-    return std::max_element(std::begin(history_), std::end(history_), less_loglik_or_tie_farther());
-}
-
-MapGrid::const_iterator GradientDescent::const_max_iterator() const {HERE;
-    return std::max_element(std::begin(history_), std::end(history_), less_loglik_or_tie_farther());
+std::pair<std::valarray<double>, double> GradientDescent::max_point() const {HERE;
+    std::pair<std::valarray<double>, double> best{{}, std::numeric_limits<double>::lowest()};
+    for (size_t row=0u; row<history_.size(); ++row) {
+        auto challenger = std::make_pair(history_.params(row), history_.loglik(row));
+        if (less_loglik_or_tie_farther{}(best, challenger)) best.swap(challenger);
+    }
+    for (const auto& p: trace_) {
+        if (less_loglik_or_tie_farther{}(best, p)) best = p;
+    }
+    return best;
 }
 
 } // namespace likeligrid
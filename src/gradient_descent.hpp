@@ -5,29 +5,27 @@
 #ifndef LIKELIGRID_GRADIENT_DESCENT_HPP_
 #define LIKELIGRID_GRADIENT_DESCENT_HPP_
 
+#include "lattice.hpp"
+#include "genotype.hpp"
+
 #include <iosfwd>
 #include <string>
 #include <vector>
 #include <valarray>
-#include <map>
 #include <memory>
 
 namespace likeligrid {
 
-class GenotypeModel;
-
-class lexicographical_less {
-  public:
-    bool operator() (const std::valarray<double>& x, const std::valarray<double>&y) const {
-        return std::lexicographical_compare(std::begin(x), std::end(x), std::begin(y), std::end(y));
-    }
-};
-
-//! existing keys are checked in empty_neighbors_of()
-using MapGrid = std::map<std::valarray<double>, double, lexicographical_less>;
+class LoglikCache;
 
 class GradientDescent {
   public:
+    //! Optimization algorithms
+    enum class Method {
+        lattice,  //!< walk to the best neighbor on the 0.01 lattice
+        lbfgs     //!< L-BFGS with the analytic gradient in [0.01, 2]
+    };
+
     GradientDescent() = delete;
     GradientDescent(std::istream& ist,
         size_t max_sites,
@@ -40,27 +38,53 @@ class GradientDescent {
         const std::pair<size_t, size_t>& epistasis_pair={0u,0u},
         bool pleiotropy=false,
         unsigned int concurrency=1u);
+    //! Share the dataset loaded by another model
+    GradientDescent(
+        const GenotypeModel& model,
+        const std::pair<size_t, size_t>& epistasis_pair={0u,0u},
+        bool pleiotropy=false,
+        unsigned int concurrency=1u);
     ~GradientDescent();
 
     void run(std::ostream&);
+    void set_method(Method method) {method_ = method;}
+    //! Override the engine chosen by the model; L-BFGS needs Engine::dp
+    void set_engine(GenotypeModel::Engine engine) {model_->set_engine(engine);}
+    //! Evaluate the lattice walk in completion order instead of batches
+    void set_asynchronous(bool asynchronous) {asynchronous_ = asynchronous;}
+    //! Reuse and record loglik on the lattice; L-BFGS points are not cached.
+    //! The directory is shared through O_APPEND, which is not atomic on NFS.
+    void set_cache(const std::string& dir);
 
-    std::string outfile() const {return outfile_;}
-    MapGrid::const_iterator const_max_iterator() const;
+    std::string outfile() const {
+        return (method_ == Method::lbfgs ? "lbfgs-" : "grad-") + outfile_;
+    }
+    //! Parameters and loglik of the best point so far
+    std::pair<std::valarray<double>, double> max_point() const;
 
     /////1/////////2/////////3/////////4/////////5/////////6/////////7/////////
   private:
-    MapGrid::iterator find_better(const MapGrid::iterator&);
-    std::vector<std::valarray<double>> empty_neighbors_of(const std::valarray<double>&);
+    void run_lbfgs(std::valarray<double> theta);
+    size_t find_better(size_t row);
+    void walk_async(size_t start_row);
 
     void write(std::ostream&);
     std::tuple<std::string, size_t, std::string> read_results(const std::string&);
 
-    MapGrid::iterator max_iterator();
+    double calc_loglik(const std::valarray<double>&);
+    void record(const std::valarray<double>&, double loglik);
 
     std::unique_ptr<GenotypeModel> model_;
+    std::unique_ptr<LoglikCache> cache_;
     std::valarray<double> starting_point_;
-    MapGrid history_;
+    //! points visited on the lattice
+    LatticeTable history_;
+    //! points off the lattice such as L-BFGS iterates
+    std::vector<std::pair<std::valarray<double>, double>> trace_;
+    //! without the prefix of method
     std::string outfile_;
+    Method method_ = Method::lattice;
+    bool asynchronous_ = false;
 
     const unsigned int concurrency_;
 };
@@ -2,6 +2,8 @@
     @brief Implementation of GridSearch class
 */
 #include "gridsearch.hpp"
+#include "columnar.hpp"
+#include "lattice.hpp"
 #include "util.hpp"
 
 #include <wtl/exception.hpp>
@@ -12,13 +14,30 @@
 #include <wtl/math.hpp>
 #include <wtl/concurrent.hpp>
 #include <wtl/itertools.hpp>
+#include <wtl/scope.hpp>
 
 #include <boost/math/distributions/chi_squared.hpp>
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <cstdio>
 
 namespace likeligrid {
 
+void GridSearch::set_cache(const std::string& dir) {HERE;
+    cache_ = std::make_unique<LoglikCache>(dir, model_.fingerprint(), model_.names().size());
+}
+
+void GridSearch::set_queue(const std::string& dir, const double lease) {HERE;
+    queue_ = std::make_unique<WorkQueue>(dir, lease);
+}
+
 void GridSearch::init(const std::pair<size_t, size_t>& epistasis_pair, const bool pleiotropy) {HERE;
     model_.set_epistasis(epistasis_pair, pleiotropy);
     mle_params_.resize(model_.names().size());
@@ -41,10 +60,18 @@ void GridSearch::run_fout() {HERE;
     for (size_t j=0u; j<model_.names().size(); ++j) {
         std::cerr << model_.names()[j] << ": " << axes[j] << std::endl;
     }
+    std::cerr << "Writing: " << outfile << std::endl;
+    if (adaptive_) {
+        write_rows(outfile, refine());
+        return;
+    }
+    if (format_ != Format::tsv) {
+        run_binary(outfile, axes);
+        return;
+    }
     {
         wtl::zlib::ofstream fout(outfile, std::ios_base::out | std::ios_base::app);
-        std::cerr << "Writing: " << outfile << std::endl;
-        run_impl(fout, wtl::itertools::product(axes));
+        run_impl(fout, axes);
     }
 }
 
@@ -55,7 +82,11 @@ void GridSearch::run_cout() {HERE;
     }
     {
         std::stringstream sst;
-        run_impl(sst, wtl::itertools::product(axes));
+        if (adaptive_) {
+            write_rows(sst, refine());
+        } else {
+            run_impl(sst, axes);
+        }
         std::cout << sst.str();
         read_results(sst);
     }
@@ -63,92 +94,841 @@ void GridSearch::run_cout() {HERE;
     ++stage_;
 }
 
+inline wtl::ThreadPool& thread_pool(const unsigned int concurrency) {
+    static wtl::ThreadPool pool(concurrency);
+    return pool;
+}
+
+//! Held while a task spreads its DP levels over all threads
+inline std::mutex& shared_level_mutex() {
+    static std::mutex mtx;
+    return mtx;
+}
+
+inline std::string format_row(const double loglik, const std::valarray<double>& th_path) {
+    auto oss = wtl::make_oss();
+    oss << loglik << "\t";
+    wtl::join(th_path, oss, "\t") << "\n";
+    return oss.str();
+}
+
+inline bool better_or_tie_nearer(const double loglik, const std::valarray<double>& params,
+                                 const double best_loglik, const std::valarray<double>& best_params) {
+    if (wtl::approx(loglik, best_loglik)) {
+        return d2_from_neutral(params) < d2_from_neutral(best_params);
+    }
+    return loglik > best_loglik;
+}
+
+// Coordinate-wise refinement within the cube of the current stage.
+// In each round, all single-axis moves from the current point,
+// moves along the diagonal, and a pattern move along the last displacement
+// are evaluated in parallel, then the combination of the best move on each axis.
+// The best of them becomes the next point until none is better.
+std::vector<std::pair<double, std::valarray<double>>> GridSearch::refine() {HERE;
+    const auto axes = make_vicinity(mle_params_, BREAKS.at(stage_), radius(stage_));
+    const size_t dimensions = axes.size();
+    LatticeTable visited(dimensions);
+    std::vector<int16_t> key(dimensions);
+    std::vector<std::pair<double, std::valarray<double>>> rows;
+    auto evaluate_new = [&](const std::vector<std::valarray<double>>& points) {
+        std::vector<std::valarray<double>> unique_points;
+        for (const auto& x: points) {
+            encode_lattice(x, key.data());
+            if (visited.emplace(key.data(), 0.0).second) unique_points.push_back(x);
+        }
+        const auto logliks = calc_logliks(unique_points);
+        for (size_t i=0u; i<unique_points.size(); ++i) {
+            rows.emplace_back(logliks[i], unique_points[i]);
+        }
+        std::cerr << "." << std::flush;
+    };
+    // the best row among the given points; rows are in the order of visited
+    auto best_of = [&](const std::vector<std::valarray<double>>& points) {
+        const std::pair<double, std::valarray<double>>* best = nullptr;
+        for (const auto& x: points) {
+            encode_lattice(x, key.data());
+            const auto& row = rows[visited.find(key.data())];
+            if (!best || better_or_tie_nearer(row.first, row.second, best->first, best->second)) {
+                best = &row;
+            }
+        }
+        return *best;
+    };
+    auto nearest_on_axis = [&axes](const size_t j, const double x) {
+        return *std::min_element(std::begin(axes[j]), std::end(axes[j]),
+            [x](const double a, const double b) {return std::abs(a - x) < std::abs(b - x);});
+    };
+
+    std::valarray<double> current = mle_params_;
+    std::valarray<double> previous = current;
+    evaluate_new({current});
+    while (true) {
+        std::vector<std::valarray<double>> moves{current};
+        for (size_t j=0u; j<dimensions; ++j) {
+            for (const double x: axes[j]) {
+                if (std::abs(x - current[j]) < 1e-9) continue;
+                moves.push_back(current);
+                moves.back()[j] = x;
+            }
+        }
+        const double step = STEPS.at(stage_);
+        std::valarray<double> pattern = current, upper = current, lower = current;
+        for (size_t j=0u; j<dimensions; ++j) {
+            pattern[j] = nearest_on_axis(j, 2.0 * current[j] - previous[j]);
+            upper[j] = nearest_on_axis(j, current[j] + step);
+            lower[j] = nearest_on_axis(j, current[j] - step);
+        }
+        moves.push_back(pattern);
+        moves.push_back(upper);
+        moves.push_back(lower);
+        evaluate_new(moves);
+        std::valarray<double> combined = current;
+        for (size_t j=0u; j<dimensions; ++j) {
+            std::vector<std::valarray<double>> line;
+            for (const double x: axes[j]) {
+                line.push_back(current);
+                line.back()[j] = x;
+            }
+            combined[j] = best_of(line).second[j];
+        }
+        evaluate_new({combined});
+        moves.push_back(combined);
+        const auto next = best_of(moves).second;
+        if ((std::abs(next - current) < 1e-9).min()) break;
+        previous = current;
+        current = next;
+    }
+    std::cerr << "\n" << rows.size() << " of "
+              << wtl::itertools::product(axes).max_count() << " evaluated" << std::endl;
+    return rows;
+}
+
+std::vector<double> GridSearch::calc_logliks(const std::vector<std::valarray<double>>& points) {
+    auto futures = submit(points);
+    return collect(points, futures);
+}
+
+std::vector<std::future<double>> GridSearch::submit(const std::vector<std::valarray<double>>& points) {
+    auto task = [this](const std::valarray<double> th_path) {
+        // argument is copied for each thread; model is shared
+        return this->calc_batch({th_path})[0u];
+    };
+    auto& pool = thread_pool(concurrency_);
+    std::vector<std::future<double>> futures;
+    futures.reserve(points.size());
+    for (const auto& th_path: points) {
+        double loglik;
+        if (cache_ && cache_->find(th_path, &loglik)) {
+            std::promise<double> cached;
+            cached.set_value(loglik);
+            futures.push_back(cached.get_future());
+        } else {
+            futures.push_back(pool.submit(task, th_path));
+        }
+    }
+    return futures;
+}
+
+std::vector<double> GridSearch::collect(const std::vector<std::valarray<double>>& points,
+                                        std::vector<std::future<double>>& futures) {
+    std::vector<double> logliks;
+    logliks.reserve(points.size());
+    for (size_t i=0u; i<points.size(); ++i) {
+        logliks.push_back(futures[i].get());
+        if (cache_) cache_->insert(points[i], logliks.back());
+    }
+    if (cache_) cache_->flush();
+    if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+    return logliks;
+}
+
+void GridSearch::write_rows(std::ostream& ost, const std::vector<std::pair<double, std::valarray<double>>>& rows) const {
+    write_header(ost, rows.size());
+    for (const auto& row: rows) {
+        ost << format_row(row.first, row.second);
+    }
+}
+
+// Written at once after the stage; an interrupted stage is evaluated again.
+void GridSearch::write_rows(const std::string& outfile, const std::vector<std::pair<double, std::valarray<double>>>& rows) const {
+    std::remove(outfile.c_str());
+    if (format_ == Format::tsv) {
+        wtl::zlib::ofstream fout(outfile);
+        write_rows(fout, rows);
+        return;
+    }
+    std::ostringstream header;
+    write_header(header, rows.size());
+    ColumnarWriter writer(outfile, header.str(), model_.names().size() + 1u,
+                          format_ == Format::binary_zlib);
+    for (const auto& row: rows) {
+        writer.push_back(row.first, row.second);
+    }
+}
+
+// Limits, the last stage, adaptive and distributed grids are evaluated exactly
+bool GridSearch::prefiltering() const {
+    return prefilter_ > 0.0 && stage_ + 1u < STEPS.size() && !adaptive_ && !queue_;
+}
+
+// Small enough to keep all threads busy and their DP levels in memory
+size_t GridSearch::batch_size(const size_t num_points, const size_t max_size) const {
+    return std::max<size_t>(1u, std::min({max_size, num_points / (4u * concurrency_), max_batch_in_memory()}));
+}
+
+size_t GridSearch::max_batch_in_memory() const {
+    if (model_.engine() != GenotypeModel::Engine::dp) return std::numeric_limits<size_t>::max();
+    const double bytes = static_cast<double>(concurrency_) * std::max(model_.dp_bytes(), 1.0);
+    return static_cast<size_t>(std::min(GenotypeModel::memory_limit() / bytes, 1e9));
+}
+
+// Levels too large for a copy per thread are computed by all threads together,
+// one batch at a time.
+std::vector<double> GridSearch::calc_batch(const std::vector<std::valarray<double>>& points,
+                                           const bool approximate) const {
+    unsigned int concurrency = 1u;
+    std::unique_lock<std::mutex> lock(shared_level_mutex(), std::defer_lock);
+    if (max_batch_in_memory() == 0u) {
+        lock.lock();
+        concurrency = concurrency_;
+    }
+    if (approximate) return model_.approx_loglik_batch(points, concurrency);
+    return model_.calc_loglik_batch(points, concurrency);
+}
+
+// Uniaxis lines are interpolated by AxisLoglik prepared for all axes at once,
+// or bracketed if bisection_; the axes whose brackets are not monotone are scanned.
+// The limit grids of all parameters are then evaluated in one pipeline.
 void GridSearch::search_limits() {HERE;
     namespace bmath = boost::math;
     bmath::chi_squared_distribution<> chisq(1.0);
     const double diff95 = 0.5 * bmath::quantile(bmath::complement(chisq, 0.05));
+    const size_t dimensions = model_.names().size();
+    std::vector<std::vector<std::pair<double, std::valarray<double>>>> lines(dimensions);
+    if (bisection_) {
+        lines = bisect_limits(diff95);
+    }
     auto axis = wtl::round(wtl::lin_spaced(200, 2.0, 0.01), 100);
     axis = (axis * 100.0).apply(std::round) / 100.0;
-    std::map<std::string, std::valarray<double>> intersections;
-    for (size_t i=0u; i<model_.names().size(); ++i) {
+    const double axis_min = axis.min(), axis_max = axis.max();
+    auto task = [this,axis_min,axis_max](const size_t i) {
+        // an axis holds the levels of all its nodes
+        std::unique_lock<std::mutex> lock(shared_level_mutex(), std::defer_lock);
+        unsigned int concurrency = 1u;
+        if (this->max_batch_in_memory() < this->model_.max_sites() + 1u) {
+            lock.lock();
+            concurrency = this->concurrency_;
+        }
+        return this->model_.calc_axis(this->mle_params_, i, axis_min, axis_max, concurrency);
+    };
+    auto& pool = thread_pool(concurrency_);
+    std::vector<std::future<AxisLoglik>> futures(dimensions);
+    for (size_t i=0u; i<dimensions; ++i) {
+        if (lines[i].empty()) futures[i] = pool.submit(task, i);
+    }
+    std::vector<std::pair<std::string, std::valarray<double>>> bounds;
+    for (size_t i=0u; i<dimensions; ++i) {
+        auto& rows = lines[i];
+        if (futures[i].valid()) {
+            const AxisLoglik uniaxis = futures[i].get();
+            if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+            for (const double x: axis) {
+                rows.emplace_back(uniaxis(x), mle_params_);
+                rows.back().second[i] = x;
+            }
+        }
         const std::string outfile = "uniaxis-" + model_.names()[i] + ".tsv.gz";
         std::cerr << outfile << std::endl;
-        std::stringstream sst;
-        run_impl(sst, wtl::itertools::uniaxis(axis, mle_params_, i));
-        wtl::zlib::ofstream(outfile) << sst.str();
-        const auto logliks = read_loglik(sst, axis.size());
-        const double threshold = logliks.max() - diff95;
-        const std::valarray<double> range = axis[logliks > threshold];
+        {
+            wtl::zlib::ofstream fout(outfile);
+            write_rows(fout, rows);
+        }
+        double threshold = rows.front().first;
+        for (const auto& row: rows) {threshold = std::max(threshold, row.first);}
+        threshold -= diff95;
+        // range of the points above the threshold
+        double lo = 2.00, hi = 0.01;
+        for (const auto& row: rows) {
+            if (row.first > threshold) {
+                lo = std::min(lo, row.second[i]);
+                hi = std::max(hi, row.second[i]);
+            }
+        }
         auto bound_params = mle_params_;
-        bound_params[i] = std::max(range.min() - 0.01, 0.01);
-        intersections.emplace(model_.names()[i] + "_L", bound_params);
-        bound_params[i] = std::min(range.max() + 0.01, 2.00);
-        intersections.emplace(model_.names()[i] + "_U", bound_params);
-    }
-    for (const auto& p: intersections) {
-        const std::string outfile = "limit-" + p.first + ".tsv.gz";
-        std::cerr << outfile << ": " << p.second << std::endl;
-        const auto axes = make_vicinity(p.second, 5u, 0.02);
-        wtl::zlib::ofstream fout(outfile);
-        //TODO: if exists
-        run_impl(fout, wtl::itertools::product(axes));
+        bound_params[i] = std::max(lo - 0.01, 0.01);
+        bounds.emplace_back("limit-" + model_.names()[i] + "_L" + extension(), bound_params);
+        bound_params[i] = std::min(hi + 0.01, 2.00);
+        bounds.emplace_back("limit-" + model_.names()[i] + "_U" + extension(), bound_params);
     }
+    run_limits(bounds);
 }
 
-void GridSearch::run_impl(std::ostream& ost, wtl::itertools::Generator<std::valarray<double>>&& gen) {HERE;
+// Each side of each axis keeps a bracket [inside, outside) of lattice coordinates
+// around the crossing of the threshold, assuming loglik decreases away from the MLE.
+// All brackets are narrowed at once by evaluating evenly spaced points in them;
+// the number of points per bracket fills the pool.
+// An axis is given up if loglik increases outward in either bracket.
+// Return the evaluated points of each axis in the same order as a full scan,
+// or an empty line for the axes given up.
+std::vector<std::vector<std::pair<double, std::valarray<double>>>>
+GridSearch::bisect_limits(const double diff95) {HERE;
+    const size_t dimensions = mle_params_.size();
+    std::vector<int16_t> center(dimensions);
+    const bool on_lattice = encode_lattice(mle_params_, center.data());
+    WTL_ASSERT(on_lattice);
+    const double max_loglik = calc_logliks({mle_params_})[0u];
+    const double threshold = max_loglik - diff95;
+    struct Bracket {
+        size_t axis;
+        int inside;
+        int outside;
+        double inside_loglik;
+        double outside_loglik;
+    };
+    constexpr double unknown = -std::numeric_limits<double>::infinity();
+    auto increases = [](const double from, const double to) {
+        return to > from && !wtl::approx(to, from);
+    };
+    std::vector<Bracket> brackets;
+    for (size_t j=0u; j<dimensions; ++j) {
+        // 0.00 and 2.01 are outside by definition
+        brackets.push_back({j, center[j], 0, max_loglik, unknown});
+        brackets.push_back({j, center[j], 201, max_loglik, unknown});
+    }
+    std::vector<bool> monotone(dimensions, true);
+    std::vector<std::vector<std::pair<double, std::valarray<double>>>> lines(dimensions);
+    for (auto& rows: lines) {rows.emplace_back(max_loglik, mle_params_);}
+    size_t num_evaluated = 1u;
+    while (true) {
+        std::vector<Bracket*> active;
+        for (auto& bracket: brackets) {
+            if (monotone[bracket.axis] && std::abs(bracket.outside - bracket.inside) > 1) {
+                active.push_back(&bracket);
+            }
+        }
+        if (active.empty()) break;
+        const int per_bracket = static_cast<int>(std::max<size_t>(1u, concurrency_ / active.size()));
+        std::vector<std::valarray<double>> points;
+        std::vector<std::pair<Bracket*, int>> owners;
+        for (Bracket* bracket: active) {
+            const int width = bracket->outside - bracket->inside;
+            const int n = std::min(per_bracket, std::abs(width) - 1);
+            for (int m=1; m<=n; ++m) {
+                const int coord = bracket->inside + width * m / (n + 1);
+                points.push_back(mle_params_);
+                points.back()[bracket->axis] = coord / 100.0;
+                owners.emplace_back(bracket, coord);
+            }
+        }
+        const auto logliks = calc_logliks(points);
+        num_evaluated += points.size();
+        // points of a bracket are ordered from inside to outside
+        const Bracket* crossed = nullptr;
+        const Bracket* previous = nullptr;
+        double previous_loglik = unknown;
+        for (size_t k=0u; k<points.size(); ++k) {
+            Bracket* bracket = owners[k].first;
+            lines[bracket->axis].emplace_back(logliks[k], points[k]);
+            if (bracket != previous) previous_loglik = bracket->inside_loglik;
+            if (increases(previous_loglik, logliks[k]) || increases(logliks[k], bracket->outside_loglik)) {
+                monotone[bracket->axis] = false;
+            }
+            previous = bracket;
+            previous_loglik = logliks[k];
+            if (bracket == crossed) continue;
+            if (logliks[k] > threshold) {
+                bracket->inside = owners[k].second;
+                bracket->inside_loglik = logliks[k];
+            } else {
+                bracket->outside = owners[k].second;
+                bracket->outside_loglik = logliks[k];
+                crossed = bracket;
+            }
+        }
+        std::cerr << "." << std::flush;
+    }
+    std::cerr << "\n" << num_evaluated << " of " << 200u * dimensions << " evaluated" << std::endl;
+    for (size_t j=0u; j<dimensions; ++j) {
+        if (!monotone[j]) {
+            std::cerr << model_.names()[j] << ": not monotone; scanned instead" << std::endl;
+            lines[j].clear();
+            continue;
+        }
+        std::sort(lines[j].begin(), lines[j].end(),
+            [j](const std::pair<double, std::valarray<double>>& lhs, const std::pair<double, std::valarray<double>>& rhs) {
+                return lhs.second[j] > rhs.second[j];
+            });
+    }
+    return lines;
+}
+
+// The limit grids are consumed in order from one pipeline of batches like evaluate(),
+// so that the next grids are evaluated while the pool finishes the previous one.
+// Each file is written at once when its grid is done.
+// Distributed grids are evaluated one by one through the queue.
+void GridSearch::run_limits(const std::vector<std::pair<std::string, std::valarray<double>>>& bounds) {HERE;
+    std::vector<std::vector<std::valarray<double>>> grids;
+    for (const auto& bound: bounds) {
+        std::cerr << bound.first << ": " << bound.second << std::endl;
+        grids.push_back(make_vicinity(bound.second, 5u, 0.02));
+    }
+    if (queue_) {
+        for (size_t g=0u; g<grids.size(); ++g) {
+            if (format_ != Format::tsv) {
+                run_binary(bounds[g].first, grids[g]);
+                continue;
+            }
+            wtl::zlib::ofstream fout(bounds[g].first);
+            run_impl(fout, grids[g]);
+        }
+        return;
+    }
+    auto task = [this](const std::vector<std::valarray<double>> points) {
+        // argument is copied for each thread; model is shared
+        return this->calc_batch(points);
+    };
+    struct Batch {
+        size_t grid;
+        std::vector<std::valarray<double>> points;
+        //! cached
+        std::vector<bool> known;
+        //! known loglik or 0.0
+        std::vector<double> logliks;
+        std::future<std::vector<double>> evaluated;
+    };
+    std::deque<Batch> evaluating;
+    std::vector<std::pair<double, std::valarray<double>>> rows;
+    auto pop_front = [&]() {
+        Batch batch = std::move(evaluating.front());
+        evaluating.pop_front();
+        const auto evaluated = batch.evaluated.get();
+        for (size_t k=0u, e=0u; k<batch.points.size(); ++k) {
+            const double loglik = batch.known[k] ? batch.logliks[k] : evaluated[e++];
+            if (cache_ && !batch.known[k]) cache_->insert(batch.points[k], loglik);
+            rows.emplace_back(loglik, std::move(batch.points[k]));
+        }
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+        if (rows.size() == wtl::itertools::product(grids[batch.grid]).max_count()) {
+            write_rows(bounds[batch.grid].first, rows);
+            rows.clear();
+            if (cache_) cache_->flush();
+        }
+    };
+    auto& pool = thread_pool(concurrency_);
+    const size_t max_pending = 2u * concurrency_;
+    for (size_t g=0u; g<grids.size(); ++g) {
+        auto gen = wtl::itertools::product(grids[g]);
+        const size_t batch_size = this->batch_size(gen.max_count(), 16u);
+        Batch batch;
+        std::vector<std::valarray<double>> uncached;
+        auto submit_batch = [&]() {
+            batch.grid = g;
+            if (uncached.empty()) {
+                std::promise<std::vector<double>> known;
+                known.set_value({});
+                batch.evaluated = known.get_future();
+            } else {
+                batch.evaluated = pool.submit(task, std::move(uncached));
+            }
+            evaluating.push_back(std::move(batch));
+            if (evaluating.size() >= max_pending) {pop_front();}
+            uncached.clear();
+            batch = Batch();
+        };
+        for (const auto& th_path: gen()) {
+            double loglik;
+            if (cache_ && cache_->find(th_path, &loglik)) {
+                batch.known.push_back(true);
+                batch.logliks.push_back(loglik);
+            } else {
+                batch.known.push_back(false);
+                batch.logliks.push_back(0.0);
+                uncached.push_back(th_path);
+            }
+            batch.points.push_back(th_path);
+            if (batch.points.size() >= batch_size) {submit_batch();}
+        }
+        if (!batch.points.empty()) {submit_batch();}
+    }
+    while (!evaluating.empty()) {pop_front();}
+}
+
+// Points are evaluated in batches by calc_loglik_batch().
+// Results are consumed in order with a bounded number of pending batches.
+// `due` is true at most once per second and at the end.
+// Cached points are consumed without being submitted.
+// With the prefilter, each batch is evaluated in single precision first,
+// and the points within the tolerance of the best exact loglik so far
+// (including the center and the rows read by resume()) are evaluated again.
+// The others are flagged in the APPROXIMATE column.
+template <class Encode, class Consume>
+void GridSearch::evaluate(const std::vector<std::valarray<double>>& axes,
+                          Encode&& encode, Consume&& consume) {
+    if (queue_) {
+        distribute(axes, encode, consume);
+        return;
+    }
+    auto gen = wtl::itertools::product(axes);
     std::cerr << skip_ << " to " << gen.max_count() << std::endl;
-    if (skip_ == 0u) {
-        write_header(ost, gen.max_count());
+    const size_t hits = cache_ ? cache_->hits() : 0u;
+    const bool filtering = prefiltering();
+    double best_loglik = best_loglik_;
+    if (filtering && skip_ < gen.max_count()) {
+        // the center of the vicinity is on the grid
+        best_loglik = std::max(best_loglik, calc_logliks({mle_params_})[0u]);
     }
+    auto task = [this](const std::vector<std::valarray<double>> points) {
+        // argument is copied for each thread; model is shared
+        return this->calc_batch(points);
+    };
+    auto approx_task = [this](const std::vector<std::valarray<double>> points) {
+        return this->calc_batch(points, true);
+    };
+    auto ready = []() {
+        std::promise<std::vector<double>> known;
+        known.set_value({});
+        return known.get_future();
+    };
+    struct Batch {
+        std::vector<std::valarray<double>> points;
+        //! cached or approximate
+        std::vector<bool> known;
+        std::vector<bool> approximate;
+        //! known loglik or 0.0
+        std::vector<double> logliks;
+        //! single-precision logliks of the uncached points
+        std::future<std::vector<double>> approximated;
+        //! logliks of the other points
+        std::future<std::vector<double>> evaluated;
+    };
 
-    auto task = [this](const std::valarray<double> th_path) {
-        // argument and model are copied for each thread
-        auto buffer = wtl::make_oss();
-        auto model_copy = this->model_;
-        buffer << model_copy.calc_loglik(th_path) << "\t";
-        wtl::join(th_path, buffer, "\t") << "\n";
-        return buffer.str();
+    size_t stars = 0u;
+    size_t i = skip_;
+    size_t num_evaluated = 0u;
+    const auto min_interval = std::chrono::seconds(1);
+    auto next_time = std::chrono::system_clock::now();
+    std::deque<Batch> approximating;
+    std::deque<Batch> evaluating;
+    std::valarray<double> row(model_.names().size() + 1u);
+    auto pop_front = [&]() {
+        Batch batch = std::move(evaluating.front());
+        evaluating.pop_front();
+        const auto evaluated = batch.evaluated.get();
+        for (size_t k=0u, e=0u; k<batch.points.size(); ++k) {
+            const double loglik = batch.known[k] ? batch.logliks[k] : evaluated[e++];
+            const std::valarray<double>& th_path = batch.points[k];
+            ++i;
+            auto now = std::chrono::system_clock::now();
+            const bool due = (now > next_time || i == gen.max_count());
+            if (cache_) {
+                if (!batch.known[k]) cache_->insert(th_path, loglik);
+                if (due) {cache_->flush();}
+            }
+            if (filtering) {
+                if (!batch.approximate[k]) best_loglik = std::max(best_loglik, loglik);
+                row[std::slice(0u, th_path.size(), 1u)] = th_path;
+                row[th_path.size()] = batch.approximate[k] ? 1.0 : 0.0;
+                consume(encode(loglik, row), due);
+            } else {
+                consume(encode(loglik, th_path), due);
+            }
+            if (due) {
+                next_time = now + min_interval;
+                for (size_t n= static_cast<size_t>(20.0 * i / gen.max_count()); stars<n; ++stars) {
+                    std::cerr << "*";
+                }
+            }
+        }
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
     };
 
-    static wtl::ThreadPool pool(concurrency_);
-    std::vector<std::future<std::string>> futures;
-    futures.reserve(gen.max_count() - skip_);
+    auto& pool = thread_pool(concurrency_);
+    const size_t max_pending = 2u * concurrency_;
+    auto push_back = [&](Batch&& batch, std::vector<std::valarray<double>>&& uncached) {
+        if (uncached.empty()) {
+            batch.evaluated = ready();
+        } else {
+            num_evaluated += uncached.size();
+            batch.evaluated = pool.submit(task, std::move(uncached));
+        }
+        evaluating.push_back(std::move(batch));
+        if (evaluating.size() >= max_pending) {pop_front();}
+    };
+    // points below the threshold stay approximate
+    auto filter_front = [&]() {
+        Batch batch = std::move(approximating.front());
+        approximating.pop_front();
+        const auto approximated = batch.approximated.get();
+        const double threshold = best_loglik - prefilter_;
+        std::vector<std::valarray<double>> uncached;
+        for (size_t k=0u, e=0u; k<batch.points.size(); ++k) {
+            if (batch.known[k]) continue;
+            const double approx = approximated[e++];
+            if (approx < threshold) {
+                batch.known[k] = true;
+                batch.approximate[k] = true;
+                batch.logliks[k] = approx;
+            } else {
+                uncached.push_back(batch.points[k]);
+            }
+        }
+        push_back(std::move(batch), std::move(uncached));
+    };
+    const size_t batch_size = this->batch_size(gen.max_count() - skip_, filtering ? 32u : 16u);
+    Batch batch;
+    std::vector<std::valarray<double>> uncached;
+    auto submit_batch = [&]() {
+        if (!filtering) {
+            push_back(std::move(batch), std::move(uncached));
+        } else {
+            batch.approximated = uncached.empty() ? ready() : pool.submit(approx_task, std::move(uncached));
+            approximating.push_back(std::move(batch));
+            if (approximating.size() >= max_pending) {filter_front();}
+        }
+        uncached.clear();
+        batch = Batch();
+    };
     for (const auto& th_path: gen(skip_)) {
-        futures.push_back(pool.submit(task, th_path));
+        double loglik;
+        if (cache_ && cache_->find(th_path, &loglik)) {
+            batch.known.push_back(true);
+            batch.logliks.push_back(loglik);
+        } else {
+            batch.known.push_back(false);
+            batch.logliks.push_back(0.0);
+            uncached.push_back(th_path);
+        }
+        batch.approximate.push_back(false);
+        batch.points.push_back(th_path);
+        if (batch.points.size() >= batch_size) {submit_batch();}
+    }
+    if (!batch.points.empty()) {submit_batch();}
+    while (!approximating.empty()) {filter_front();}
+    while (!evaluating.empty()) {pop_front();}
+    std::cerr << "\n";
+    if (filtering) {
+        std::cerr << "prefilter: " << num_evaluated << " of " << gen.max_count() - skip_
+                  << " evaluated in double precision" << std::endl;
+    }
+    if (cache_) {
+        std::cerr << "cache hits: " << cache_->hits() - hits << std::endl;
     }
+}
+
+// Chunks are put to the queue and consumed in order like the batches in evaluate().
+// Only a window of chunks ahead of the consumed one are put at a time.
+// The next chunk is evaluated by this process unless a worker has claimed it.
+// Chunks found entirely in the cache are not put.
+template <class Encode, class Consume>
+void GridSearch::distribute(const std::vector<std::valarray<double>>& axes,
+                            Encode&& encode, Consume&& consume) {
+    auto gen = wtl::itertools::product(axes);
+    const size_t max_count = gen.max_count();
+    // at most 256 batches of calc_chunk()
+    const size_t chunk_size = std::min<size_t>(std::max<size_t>(64u, (max_count + 63u) / 64u), 256u * 16u);
+    const size_t max_ahead = 32u * chunk_size;
+    const std::string job = queue_->post(model_.fingerprint(), axes, chunk_size);
+    auto at_exit = wtl::scope_exit([this,&job]() {queue_->close(job);});
+    std::cerr << job << ": " << skip_ << " to " << max_count << std::endl;
+    std::map<size_t, std::vector<double>> cached;
+    auto put = [&](const size_t begin) {
+        const size_t end = std::min(begin + chunk_size, max_count);
+        if (cache_) {
+            std::vector<double> logliks;
+            logliks.reserve(end - begin);
+            auto chunk_gen = wtl::itertools::product(axes);
+            size_t i = begin;
+            double loglik;
+            for (const auto& th_path: chunk_gen(begin)) {
+                if (i++ == end || !cache_->find(th_path, &loglik)) break;
+                logliks.push_back(loglik);
+            }
+            if (logliks.size() == end - begin) {
+                cached.emplace(begin, std::move(logliks));
+                return;
+            }
+        }
+        queue_->put(job, begin);
+    };
+    size_t next_put = skip_;
+    auto wait = [&](const size_t begin, std::vector<double>* logliks) {
+        for (; next_put < std::min(begin + max_ahead, max_count); next_put += chunk_size) {
+            put(next_put);
+        }
+        auto it = cached.find(begin);
+        if (it != cached.end()) {
+            logliks->swap(it->second);
+            cached.erase(it);
+            return;
+        }
+        while (!queue_->take(job, begin, logliks)) {
+            if (queue_->claim(job, begin)) {
+                const size_t end = std::min(begin + chunk_size, max_count);
+                auto heartbeat = [this,&job,begin]() {
+                    queue_->touch(job);
+                    queue_->touch(job, begin);
+                };
+                queue_->complete(job, begin, calc_chunk(axes, begin, end, heartbeat));
+                continue;
+            }
+            queue_->touch(job);
+            queue_->requeue();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+        }
+    };
 
-    auto buffer = wtl::make_oss();
     size_t stars = 0u;
     size_t i = skip_;
     const auto min_interval = std::chrono::seconds(1);
     auto next_time = std::chrono::system_clock::now();
-    for (auto& ftr: futures) {
-        buffer << ftr.get();
+    std::vector<double> logliks;
+    size_t k = 0u;
+    for (const auto& th_path: gen(skip_)) {
+        if (k == logliks.size()) {
+            wait(i, &logliks);
+            k = 0u;
+        }
+        const double loglik = logliks[k++];
         ++i;
         auto now = std::chrono::system_clock::now();
-        if (now > next_time || &ftr == &futures.back()) {
+        const bool due = (now > next_time || i == max_count);
+        if (cache_) {
+            cache_->insert(th_path, loglik);
+            if (due) {cache_->flush();}
+        }
+        consume(encode(loglik, th_path), due);
+        if (due) {
             next_time = now + min_interval;
-            ost << buffer.str();
-            buffer.str("");
-            buffer.clear();
-            for (size_t n= static_cast<size_t>(20.0 * i / gen.max_count()); stars<n; ++stars) {
+            for (size_t n= static_cast<size_t>(20.0 * i / max_count); stars<n; ++stars) {
                 std::cerr << "*";
             }
         }
-        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
     }
     std::cerr << "\n";
 }
 
+// Batches are generated as the threads become free, like in evaluate().
+std::vector<double> GridSearch::calc_chunk(const std::vector<std::valarray<double>>& axes,
+                                           const size_t begin, const size_t end,
+                                           const std::function<void()>& heartbeat) {
+    auto task = [this](const std::vector<std::valarray<double>> points) {
+        return this->calc_batch(points);
+    };
+    auto& pool = thread_pool(concurrency_);
+    const size_t batch_size = this->batch_size(end - begin, 16u);
+    const size_t max_pending = 2u * concurrency_;
+    std::deque<std::future<std::vector<double>>> futures;
+    std::vector<double> logliks;
+    logliks.reserve(end - begin);
+    auto pop_front = [&]() {
+        const auto values = futures.front().get();
+        futures.pop_front();
+        logliks.insert(logliks.end(), values.begin(), values.end());
+        heartbeat();
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+    };
+    std::vector<std::valarray<double>> points;
+    auto gen = wtl::itertools::product(axes);
+    size_t i = begin;
+    for (const auto& th_path: gen(begin)) {
+        if (i++ == end) break;
+        points.push_back(th_path);
+        if (points.size() >= batch_size) {
+            if (futures.size() >= max_pending) {pop_front();}
+            futures.push_back(pool.submit(task, std::move(points)));
+            points.clear();
+        }
+    }
+    if (!points.empty()) {futures.push_back(pool.submit(task, std::move(points)));}
+    while (!futures.empty()) {pop_front();}
+    return logliks;
+}
+
+// Workers stop when no job has been posted for the lease.
+void GridSearch::work() {HERE;
+    if (!queue_) throw std::runtime_error("work() requires set_queue()");
+    const std::string fingerprint = model_.fingerprint();
+    std::cerr << "fingerprint: " << fingerprint << std::endl;
+    WorkQueue::Chunk chunk;
+    size_t num_chunks = 0u;
+    auto last_active = std::chrono::steady_clock::now();
+    while (true) {
+        const auto now = std::chrono::steady_clock::now();
+        if (queue_->claim_any(fingerprint, &chunk)) {
+            std::cerr << chunk.job << ": " << chunk.begin << " to " << chunk.end << std::endl;
+            auto heartbeat = [this,&chunk]() {queue_->touch(chunk.job, chunk.begin);};
+            queue_->complete(chunk.job, chunk.begin, calc_chunk(*chunk.axes, chunk.begin, chunk.end, heartbeat));
+            ++num_chunks;
+            last_active = std::chrono::steady_clock::now();
+            continue;
+        }
+        if (queue_->busy()) {
+            last_active = now;
+        } else if (now - last_active > std::chrono::duration<double>(queue_->lease())) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (wtl::SIGINT_RAISED()) {throw wtl::KeyboardInterrupt();}
+    }
+    std::cerr << num_chunks << " chunks evaluated" << std::endl;
+}
+
+void GridSearch::run_impl(std::ostream& ost, const std::vector<std::valarray<double>>& axes) {HERE;
+    if (skip_ == 0u) {
+        write_header(ost, wtl::itertools::product(axes).max_count());
+    }
+    auto buffer = wtl::make_oss();
+    auto encode = [](const double loglik, const std::valarray<double>& th_path) {
+        return format_row(loglik, th_path);
+    };
+    auto consume = [&ost,&buffer](const std::string& line, const bool due) {
+        buffer << line;
+        if (due) {
+            ost << buffer.str();
+            buffer.str("");
+            buffer.clear();
+        }
+    };
+    evaluate(axes, encode, consume);
+}
+
+void GridSearch::run_binary(const std::string& outfile, const std::vector<std::valarray<double>>& axes) {HERE;
+    if (skip_ == 0u) {
+        std::remove(outfile.c_str());
+    }
+    std::ostringstream header;
+    write_header(header, wtl::itertools::product(axes).max_count());
+    const size_t num_columns = model_.names().size() + (prefiltering() ? 2u : 1u);
+    ColumnarWriter writer(outfile, header.str(), num_columns, format_ == Format::binary_zlib);
+    auto encode = [](const double loglik, const std::valarray<double>& th_path) {
+        return std::make_pair(loglik, th_path);
+    };
+    auto consume = [&writer](const std::pair<double, std::valarray<double>>& row, const bool due) {
+        writer.push_back(row.first, row.second);
+        if (due) {writer.flush();}
+    };
+    evaluate(axes, encode, consume);
+}
+
 std::string GridSearch::init_meta() {HERE;
     if (stage_ >= STEPS.size()) return "";
     auto oss = wtl::make_oss(2u, std::ios_base::fixed);
-    oss << "grid-" << STEPS.at(stage_) << ".tsv.gz";
+    oss << "grid-" << STEPS.at(stage_) << extension();
     std::string outfile = oss.str();
     try {
-        wtl::zlib::ifstream ist(outfile);
-        std::cerr << "Reading: " << outfile << std::endl;
-        read_results(ist);
+        if (format_ == Format::tsv) {
+            wtl::zlib::ifstream ist(outfile);
+            std::cerr << "Reading: " << outfile << std::endl;
+            read_results(ist);
+        } else {
+            const auto checkpoint = read_checkpoint(outfile);
+            // killed before the header was written
+            if (checkpoint.valid_size == 0u) return outfile;
+            std::cerr << "Reading: " << outfile << std::endl;
+            read_results(checkpoint);
+        }
         if (skip_ == 0u) {
             ++stage_;
             outfile = init_meta();
@@ -163,17 +943,41 @@ void GridSearch::read_results(std::istream& ist) {HERE;
     size_t max_count;
     double step;
     std::tie(std::ignore, std::ignore, max_count, step) = read_metadata(ist);
-    stage_ = guess_stage(step);
-    std::vector<std::string> colnames;
+    size_t num_rows;
     std::valarray<double> mle_params;
-    std::tie(skip_, colnames, mle_params) = read_body(ist);
+    double max_loglik;
+    std::tie(num_rows, std::ignore, mle_params, max_loglik) = read_body(ist);
+    resume(max_count, step, num_rows, mle_params, max_loglik);
+}
+
+void GridSearch::read_results(const ColumnarCheckpoint& checkpoint) {HERE;
+    size_t max_count;
+    double step;
+    std::istringstream iss(checkpoint.header);
+    std::tie(std::ignore, std::ignore, max_count, step) = read_metadata(iss);
+    resume(max_count, step, checkpoint.num_rows, checkpoint.mle_params, checkpoint.max_loglik);
+}
+
+void GridSearch::resume(const size_t max_count, const double step,
+                        const size_t num_rows, const std::valarray<double>& mle_params,
+                        const double max_loglik) {
+    stage_ = guess_stage(step);
+    skip_ = num_rows;
+    best_loglik_ = max_loglik;
     if (skip_ == max_count) {  // is complete file
         skip_ = 0u;
-        mle_params_.swap(mle_params);
+        mle_params_ = mle_params;
+        best_loglik_ = std::numeric_limits<double>::lowest();
     }
 }
 
 void GridSearch::read_results(const std::string& infile) {
+    if (is_columnar(infile)) {
+        const auto checkpoint = read_checkpoint(infile);
+        if (checkpoint.valid_size == 0u) throw std::runtime_error("incomplete binary result file: " + infile);
+        read_results(checkpoint);
+        return;
+    }
     wtl::zlib::ifstream ist(infile);
     read_results(ist);
 }
@@ -184,7 +988,9 @@ void GridSearch::write_header(std::ostream& ost, const size_t max_count) const {
     ost << "##max_count=" << max_count << "\n";
     ost << "##step=" << STEPS.at(stage_) << "\n";
     ost << "loglik\t";
-    wtl::join(model_.names(), ost, "\t") << "\n";
+    wtl::join(model_.names(), ost, "\t");
+    if (prefiltering()) {ost << "\t" << APPROXIMATE;}
+    ost << "\n";
 }
 
 } // namespace likeligrid
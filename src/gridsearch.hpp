@@ -6,10 +6,16 @@
 #define LIKELIGRID_GRIDSEARCH_HPP_
 
 #include "genotype.hpp"
+#include "cache.hpp"
+#include "queue.hpp"
 
 #include <string>
 #include <vector>
 #include <valarray>
+#include <memory>
+#include <future>
+#include <functional>
+#include <limits>
 
 namespace wtl {namespace itertools {
   template <class T> class Generator;
@@ -17,8 +23,17 @@ namespace wtl {namespace itertools {
 
 namespace likeligrid {
 
+struct ColumnarCheckpoint;
+
 class GridSearch {
   public:
+    //! Formats of result files
+    enum class Format {
+        tsv,         //!< gzipped text
+        binary,      //!< columnar doubles
+        binary_zlib  //!< columnar doubles in zlib-compressed blocks
+    };
+
     GridSearch() = delete;
     GridSearch(std::istream& ist,
         size_t max_sites,
@@ -35,6 +50,16 @@ class GridSearch {
         bool pleiotropy=false,
         unsigned int concurrency=1u)
         : GridSearch(ist, max_sites, epistasis_pair, pleiotropy, concurrency){}
+    //! Share the dataset loaded by another model
+    GridSearch(
+        const GenotypeModel& model,
+        const std::pair<size_t, size_t>& epistasis_pair={0u,0u},
+        bool pleiotropy=false,
+        unsigned int concurrency=1u)
+        : model_(model),
+          concurrency_(concurrency) {
+        init(epistasis_pair, pleiotropy);
+    }
     GridSearch(
         const std::string& infile,
         size_t max_sites,
@@ -48,6 +73,41 @@ class GridSearch {
 
     void run(bool writing=true);
     void run_cout();
+    void set_format(Format format) {format_ = format;}
+    //! Override the engine chosen by the model
+    void set_engine(GenotypeModel::Engine engine) {model_.set_engine(engine);}
+    //! Evaluate only the cells visited by coordinate-wise refinement in each stage
+    void set_adaptive(bool adaptive) {adaptive_ = adaptive;}
+    //! Locate the 95% limits on uniaxis lines by bracketing instead of 200-point scans;
+    //! the axes on which loglik is not monotone are scanned
+    void set_bisection(bool bisection) {bisection_ = bisection;}
+    /*! @brief Evaluate stages before the last in single precision first
+
+        Only points within `tolerance` of the best exact loglik so far
+        are evaluated again in double precision;
+        the other rows are written with approximate loglik and flagged
+        in the last column APPROXIMATE, which is skipped in choosing MLE.
+        The MLE is evaluated exactly if `tolerance` exceeds the error of
+        approx_loglik_batch(), around 1e-5 for loglik of -1e4.
+        Not applied to adaptive or distributed grids.
+    */
+    void set_prefilter(double tolerance) {prefilter_ = tolerance;}
+    /*! @brief Reuse and record loglik in a directory shared with other runs
+
+        Processes append to the same file under flock() relying on O_APPEND,
+        which is not atomic on NFS; share the directory only on a local filesystem there.
+    */
+    void set_cache(const std::string& dir);
+    /*! @brief Share the grids with worker processes through a directory
+
+        Chunks unclaimed by workers are evaluated by this process.
+        Claims of crashed workers expire after `lease` seconds.
+        The prefilter is not applied to distributed grids.
+        The cache of set_cache() skips only chunks whose points are all cached.
+    */
+    void set_queue(const std::string& dir, double lease=60.0);
+    //! Evaluate chunks posted for the same model until no job is posted for a while
+    void work();
 
     void read_results(const std::string&);
 
@@ -57,16 +117,48 @@ class GridSearch {
   private:
     void init(const std::pair<size_t, size_t>&, bool pleiotropy);
     void run_fout();
-    void run_impl(std::ostream&, wtl::itertools::Generator<std::valarray<double>>&&);
+    void run_impl(std::ostream&, const std::vector<std::valarray<double>>& axes);
+    void run_binary(const std::string& outfile, const std::vector<std::valarray<double>>& axes);
+    template <class Encode, class Consume>
+    void evaluate(const std::vector<std::valarray<double>>& axes, Encode&&, Consume&&);
+    template <class Encode, class Consume>
+    void distribute(const std::vector<std::valarray<double>>& axes, Encode&&, Consume&&);
+    std::vector<double> calc_chunk(const std::vector<std::valarray<double>>& axes, size_t begin, size_t end,
+                                   const std::function<void()>& heartbeat);
+    bool prefiltering() const;
+    size_t batch_size(size_t num_points, size_t max_size) const;
+    //! Max batch whose DP levels fit in memory for every thread; 0 if none
+    size_t max_batch_in_memory() const;
+    std::vector<double> calc_batch(const std::vector<std::valarray<double>>&, bool approximate=false) const;
+    std::vector<std::pair<double, std::valarray<double>>> refine();
+    std::vector<double> calc_logliks(const std::vector<std::valarray<double>>&);
+    std::vector<std::future<double>> submit(const std::vector<std::valarray<double>>&);
+    std::vector<double> collect(const std::vector<std::valarray<double>>&, std::vector<std::future<double>>&);
+    void write_rows(std::ostream&, const std::vector<std::pair<double, std::valarray<double>>>&) const;
+    void write_rows(const std::string& outfile, const std::vector<std::pair<double, std::valarray<double>>>&) const;
     void search_limits();
+    std::vector<std::vector<std::pair<double, std::valarray<double>>>> bisect_limits(double diff95);
+    void run_limits(const std::vector<std::pair<std::string, std::valarray<double>>>& bounds);
     std::string init_meta();
     void read_results(std::istream&);
+    void read_results(const ColumnarCheckpoint&);
+    void resume(size_t max_count, double step, size_t num_rows, const std::valarray<double>& mle_params,
+                double max_loglik);
     void write_header(std::ostream&, size_t max_count) const;
+    std::string extension() const {return format_ == Format::tsv ? ".tsv.gz" : ".bin";}
 
     GenotypeModel model_;
     std::valarray<double> mle_params_;
     size_t skip_ = 0u;
+    //! max exact loglik in the rows before skip_
+    double best_loglik_ = std::numeric_limits<double>::lowest();
     size_t stage_ = 0u;
+    Format format_ = Format::tsv;
+    bool adaptive_ = false;
+    bool bisection_ = false;
+    double prefilter_ = 0.0;
+    std::unique_ptr<LoglikCache> cache_;
+    std::unique_ptr<WorkQueue> queue_;
     const unsigned int concurrency_;
 };
 
@@ -0,0 +1,206 @@
+/*! @file lattice.hpp
+    @brief Points on the 0.01 lattice packed as int16 coordinates
+*/
+#pragma once
+#ifndef LIKELIGRID_LATTICE_HPP_
+#define LIKELIGRID_LATTICE_HPP_
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <valarray>
+#include <stdexcept>
+
+namespace likeligrid {
+
+//! Coordinates θ·100; return false if theta is off the lattice
+inline bool encode_lattice(const std::valarray<double>& theta, int16_t* key) {
+    for (size_t j=0u; j<theta.size(); ++j) {
+        const double scaled = theta[j] * 100.0;
+        const double rounded = std::round(scaled);
+        if (std::fabs(scaled - rounded) > 1e-6 || rounded < 0.0
+            || rounded > std::numeric_limits<int16_t>::max()) return false;
+        key[j] = static_cast<int16_t>(rounded);
+    }
+    return true;
+}
+
+inline std::valarray<double> decode_lattice(const int16_t* key, const size_t dimensions) {
+    std::valarray<double> theta(dimensions);
+    for (size_t j=0u; j<dimensions; ++j) {
+        theta[j] = key[j] / 100.0;
+    }
+    return theta;
+}
+
+/*! @brief Open-addressing hash table of loglik on the lattice
+
+    Keys and logliks are stored in flat arrays in insertion order,
+    and slots hold row indices with linear probing.
+*/
+class LatticeTable {
+  public:
+    static constexpr size_t npos = -1;
+
+    explicit LatticeTable(size_t dimensions=0u): dimensions_(dimensions) {}
+
+    //! Row of the key or npos
+    size_t find(const int16_t* key) const {
+        if (slots_.empty()) return npos;
+        for (size_t i = hash(key) & mask(); ; i = (i + 1u) & mask()) {
+            const uint32_t slot = slots_[i];
+            if (slot == 0u) return npos;
+            if (equal(slot - 1u, key)) return slot - 1u;
+        }
+    }
+    //! Return the row of the key and whether it is newly inserted
+    std::pair<size_t, bool> emplace(const int16_t* key, const double loglik) {
+        if (2u * (size() + 1u) > slots_.size()) grow();
+        size_t i = hash(key) & mask();
+        for (; slots_[i] != 0u; i = (i + 1u) & mask()) {
+            if (equal(slots_[i] - 1u, key)) return {slots_[i] - 1u, false};
+        }
+        const size_t row = size();
+        slots_[i] = static_cast<uint32_t>(row + 1u);
+        keys_.insert(keys_.end(), key, key + dimensions_);
+        logliks_.push_back(loglik);
+        return {row, true};
+    }
+
+    size_t size() const {return logliks_.size();}
+    size_t dimensions() const {return dimensions_;}
+    const int16_t* key(size_t row) const {return keys_.data() + row * dimensions_;}
+    std::valarray<double> params(size_t row) const {return decode_lattice(key(row), dimensions_);}
+    double loglik(size_t row) const {return logliks_[row];}
+
+  private:
+    size_t mask() const {return slots_.size() - 1u;}
+    bool equal(const size_t row, const int16_t* key) const {
+        const int16_t* stored = this->key(row);
+        for (size_t j=0u; j<dimensions_; ++j) {
+            if (stored[j] != key[j]) return false;
+        }
+        return true;
+    }
+    size_t hash(const int16_t* key) const {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t j=0u; j<dimensions_; ++j) {
+            h = (h ^ static_cast<uint16_t>(key[j])) * 1099511628211ull;
+        }
+        h ^= h >> 32u;
+        h *= 0x9e3779b97f4a7c15ull;
+        return static_cast<size_t>(h ^ (h >> 29u));
+    }
+    void grow() {
+        if (2u * slots_.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::length_error("LatticeTable: too many points");
+        }
+        std::vector<uint32_t> slots(slots_.empty() ? 64u : 2u * slots_.size(), 0u);
+        slots_.swap(slots);
+        for (size_t row=0u; row<size(); ++row) {
+            size_t i = hash(key(row)) & mask();
+            while (slots_[i] != 0u) i = (i + 1u) & mask();
+            slots_[i] = static_cast<uint32_t>(row + 1u);
+        }
+    }
+
+    size_t dimensions_;
+    std::vector<int16_t> keys_;
+    std::vector<double> logliks_;
+    //! row + 1; 0 is empty
+    std::vector<uint32_t> slots_;
+};
+
+/*! @brief Neighbors of a lattice point in pseudo-random order
+
+    Each of the 3^k offsets in {-1, 0, 1}^k is visited once
+    by full-period linear congruential sequences modulo 3^40 or less
+    (multiplier ≡ 1 mod 3, increment not divisible by 3)
+    on chunks of axes combined like an odometer,
+    so the product is never materialized.
+*/
+class LatticeNeighbors {
+  public:
+    //! Neighbors stay in [1, max_coord] on each axis
+    template <class URBG>
+    LatticeNeighbors(const int16_t* center, const size_t dimensions, const int16_t max_coord, URBG& engine)
+    : center_(center, center + dimensions), max_coord_(max_coord) {
+        for (size_t begin=0u; begin<dimensions || begin==0u; begin+=max_chunk_axes) {
+            const size_t rest = dimensions - begin;
+            const size_t size = rest < max_chunk_axes ? rest : max_chunk_axes;
+            chunks_.emplace_back(begin, size, engine);
+        }
+    }
+
+    //! Set the next neighbor except the center; false at the end
+    bool next(int16_t* key) {
+        while (!finished_) {
+            bool inside = true, moved = false;
+            for (const auto& chunk: chunks_) {
+                uint64_t index = chunk.state;
+                for (size_t j=chunk.begin; j<chunk.end; ++j, index /= 3u) {
+                    const int offset = static_cast<int>(index % 3u) - 1;
+                    const int coord = center_[j] + offset;
+                    inside &= (1 <= coord && coord <= max_coord_);
+                    moved |= (offset != 0);
+                    key[j] = static_cast<int16_t>(coord);
+                }
+            }
+            advance();
+            if (inside && moved) return true;
+        }
+        return false;
+    }
+
+  private:
+    static constexpr size_t max_chunk_axes = 40u;
+
+    struct Chunk {
+        template <class URBG>
+        Chunk(const size_t first, const size_t size, URBG& engine)
+        : begin(first), end(first + size) {
+            for (size_t j=0u; j<size; ++j) modulus *= 3u;
+            const uint64_t r = static_cast<uint64_t>(engine());
+            multiplier = 1u + 3u * ((r >> 1u) % (modulus / 3u + 1u));
+            // reduction modulo 3^k keeps the residue modulo 3
+            increment = (3u * (engine() % (modulus / 3u + 1u)) + 1u + (r & 1u)) % modulus;
+            state = engine() % modulus;
+            remaining = modulus;
+        }
+        //! Return true after a full period
+        bool step() {
+            __extension__ using uint128 = unsigned __int128;
+            const auto product = static_cast<uint64_t>(static_cast<uint128>(multiplier) * state % modulus);
+            state = (product >= modulus - increment) ? product - (modulus - increment)
+                                                     : product + increment;
+            if (--remaining > 0u) return false;
+            remaining = modulus;
+            return true;
+        }
+        size_t begin;
+        size_t end;
+        uint64_t modulus = 1u;
+        uint64_t multiplier;
+        uint64_t increment;
+        uint64_t state;
+        uint64_t remaining;
+    };
+
+    void advance() {
+        for (auto& chunk: chunks_) {
+            if (!chunk.step()) return;
+        }
+        finished_ = true;
+    }
+
+    const std::vector<int16_t> center_;
+    const int16_t max_coord_;
+    std::vector<Chunk> chunks_;
+    bool finished_ = false;
+};
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_LATTICE_HPP_
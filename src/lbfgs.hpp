@@ -0,0 +1,165 @@
+/*! @file lbfgs.hpp
+    @brief Limited-memory BFGS in a box
+*/
+#pragma once
+#ifndef LIKELIGRID_LBFGS_HPP_
+#define LIKELIGRID_LBFGS_HPP_
+
+#include <valarray>
+#include <deque>
+#include <algorithm>
+#include <cmath>
+
+namespace likeligrid {
+
+/*! @brief Minimize a smooth function in `[lower, upper]`
+
+    Variables at a bound with the gradient pointing outward are fixed
+    in each iteration, and the others follow the L-BFGS two-loop recursion.
+    Steps are taken along the path projected onto the box,
+    shortened by backtracking until the Armijo condition holds.
+*/
+class ProjectedLbfgs {
+  public:
+    ProjectedLbfgs(const std::valarray<double>& lower,
+                   const std::valarray<double>& upper,
+                   size_t memory=10u)
+    : lower_(lower), upper_(upper), memory_(memory) {}
+
+    /*! @brief Minimize `fn(x, &gradient)` starting from `*x`
+
+        @return the minimum found; `*x` is updated to its argument
+    */
+    template <class Function>
+    double minimize(Function&& fn, std::valarray<double>* x) {
+        project(x);
+        std::valarray<double> grad(x->size());
+        double value = fn(*x, &grad);
+        std::valarray<double> direction(x->size());
+        std::valarray<double> new_x(x->size());
+        std::valarray<double> new_grad(x->size());
+        s_history_.clear();
+        y_history_.clear();
+        for (iterations_=0u; iterations_<max_iterations_; ++iterations_) {
+            if (projected_gradient_norm(*x, grad) < gtol_) break;
+            const std::valarray<bool> free = is_free(*x, grad);
+            search_direction(grad, free, &direction);
+            double slope = (direction * grad).sum();
+            if (slope >= 0.0) {
+                s_history_.clear();
+                y_history_.clear();
+                direction = std::valarray<double>(0.0, x->size());
+                direction[free] = -std::valarray<double>(grad[free]);
+                slope = (direction * grad).sum();
+                if (slope >= 0.0) break;
+            }
+            double step = s_history_.empty() ? std::min(1.0, 1.0 / std::sqrt(-slope)) : 1.0;
+            double new_value = 0.0;
+            bool accepted = false;
+            for (size_t trial=0u; trial<max_backtracks_; ++trial, step *= 0.5) {
+                new_x = *x + step * direction;
+                project(&new_x);
+                new_value = fn(new_x, &new_grad);
+                if (new_value <= value + ftol_armijo_ * (grad * (new_x - *x)).sum()) {
+                    accepted = true;
+                    break;
+                }
+            }
+            if (!accepted) break;
+            std::valarray<double> s = new_x - *x;
+            std::valarray<double> y = new_grad - grad;
+            if ((s * y).sum() > curvature_eps_ * std::sqrt((y * y).sum() * (s * s).sum())) {
+                s_history_.push_back(std::move(s));
+                y_history_.push_back(std::move(y));
+                if (s_history_.size() > memory_) {
+                    s_history_.pop_front();
+                    y_history_.pop_front();
+                }
+            }
+            const double decrease = value - new_value;
+            std::swap(*x, new_x);
+            std::swap(grad, new_grad);
+            value = new_value;
+            if (decrease <= ftol_ * std::max(1.0, std::abs(value))) {
+                ++iterations_;
+                break;
+            }
+        }
+        return value;
+    }
+
+    size_t iterations() const {return iterations_;}
+
+  private:
+    void project(std::valarray<double>* x) const {
+        for (size_t i=0u; i<x->size(); ++i) {
+            (*x)[i] = std::min(std::max((*x)[i], lower_[i]), upper_[i]);
+        }
+    }
+
+    double projected_gradient_norm(const std::valarray<double>& x,
+                                   const std::valarray<double>& grad) const {
+        std::valarray<double> pg = x - grad;
+        project(&pg);
+        return std::abs(std::valarray<double>(x - pg)).max();
+    }
+
+    std::valarray<bool> is_free(const std::valarray<double>& x,
+                                const std::valarray<double>& grad) const {
+        std::valarray<bool> free(true, x.size());
+        for (size_t i=0u; i<x.size(); ++i) {
+            if ((x[i] <= lower_[i] && grad[i] > 0.0) || (x[i] >= upper_[i] && grad[i] < 0.0)) {
+                free[i] = false;
+            }
+        }
+        return free;
+    }
+
+    //! Two-loop recursion restricted to free variables
+    void search_direction(const std::valarray<double>& grad,
+                          const std::valarray<bool>& free,
+                          std::valarray<double>* direction) const {
+        std::valarray<double> q(0.0, grad.size());
+        q[free] = grad[free];
+        const size_t m = s_history_.size();
+        std::valarray<double> alpha(m);
+        std::valarray<double> rho(m);
+        std::valarray<double> s(grad.size());
+        std::valarray<double> y(grad.size());
+        double gamma = 1.0;
+        for (size_t i=m; i-- > 0u;) {
+            s = 0.0; s[free] = s_history_[i][free];
+            y = 0.0; y[free] = y_history_[i][free];
+            const double sy = (s * y).sum();
+            rho[i] = sy > 0.0 ? 1.0 / sy : 0.0;
+            alpha[i] = rho[i] * (s * q).sum();
+            q -= alpha[i] * y;
+            if (i + 1u == m && sy > 0.0) {gamma = sy / (y * y).sum();}
+        }
+        q *= gamma;
+        for (size_t i=0u; i<m; ++i) {
+            s = 0.0; s[free] = s_history_[i][free];
+            y = 0.0; y[free] = y_history_[i][free];
+            const double beta = rho[i] * (y * q).sum();
+            q += (alpha[i] - beta) * s;
+        }
+        *direction = -q;
+    }
+
+    const std::valarray<double> lower_;
+    const std::valarray<double> upper_;
+    const size_t memory_;
+    const size_t max_iterations_ = 200u;
+    const size_t max_backtracks_ = 40u;
+    const double gtol_ = 1e-6;
+    const double ftol_ = 1e-12;
+    const double ftol_armijo_ = 1e-4;
+    const double curvature_eps_ = 1e-10;
+    std::deque<std::valarray<double>> s_history_;
+    std::deque<std::valarray<double>> y_history_;
+    size_t iterations_ = 0u;
+};
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_LBFGS_HPP_
@@ -0,0 +1,141 @@
+/*! @file logsumexp.cpp
+    @brief Implementation of sum_exp() dispatched by the CPU
+*/
+#include "logsumexp.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define LIKELIGRID_X86 1
+#endif
+
+namespace likeligrid {
+
+namespace {
+
+double sum_exp_scalar(const double* x, const size_t n, const double shift) {
+    double sum = 0.0;
+    for (size_t i=0u; i<n; ++i) {
+        sum += std::exp(x[i] - shift);
+    }
+    return sum;
+}
+
+#ifdef LIKELIGRID_X86
+
+// exp(x) = 2^k exp(r) with k = round(x / ln 2) and |r| <= ln 2 / 2;
+// exp(r) by the Taylor polynomial of degree 13, whose truncation error is below 1e-17.
+// Arguments below -708 underflow to 0 instead of subnormal numbers.
+constexpr double log2e = 1.4426950408889634;
+constexpr double ln2_hi = 6.93145751953125e-1;
+constexpr double ln2_lo = 1.42860682030941723212e-6;
+constexpr double min_arg = -708.0;
+//! 1/n! for n = 13, ..., 0
+constexpr double coefs[14] = {
+    1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0,
+    1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0,
+    1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0
+};
+
+__attribute__((target("avx2,fma")))
+inline __m256d exp_avx2(__m256d x) {
+    const __m256d underflow = _mm256_cmp_pd(x, _mm256_set1_pd(min_arg), _CMP_LT_OQ);
+    x = _mm256_max_pd(x, _mm256_set1_pd(min_arg));
+    const __m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(log2e)),
+                                      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(ln2_hi), x);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(ln2_lo), r);
+    __m256d p = _mm256_set1_pd(coefs[0u]);
+    for (size_t i=1u; i<14u; ++i) {
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(coefs[i]));
+    }
+    __m256i bits = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k));
+    bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+    p = _mm256_mul_pd(p, _mm256_castsi256_pd(bits));
+    return _mm256_andnot_pd(underflow, p);
+}
+
+__attribute__((target("avx2,fma")))
+double sum_exp_avx2(const double* x, const size_t n, const double shift) {
+    const __m256d vshift = _mm256_set1_pd(shift);
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0u;
+    for (; i + 4u <= n; i += 4u) {
+        acc = _mm256_add_pd(acc, exp_avx2(_mm256_sub_pd(_mm256_loadu_pd(x + i), vshift)));
+    }
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, acc);
+    double sum = (lanes[0u] + lanes[1u]) + (lanes[2u] + lanes[3u]);
+    return sum + sum_exp_scalar(x + i, n - i, shift);
+}
+
+// GCC 12 warns of _mm512_undefined_*() in the intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+inline __m512d exp_avx512(__m512d x) {
+    const __mmask8 underflow = _mm512_cmp_pd_mask(x, _mm512_set1_pd(min_arg), _CMP_LT_OQ);
+    x = _mm512_max_pd(x, _mm512_set1_pd(min_arg));
+    const __m512d k = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(log2e)),
+                                           _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(k, _mm512_set1_pd(ln2_hi), x);
+    r = _mm512_fnmadd_pd(k, _mm512_set1_pd(ln2_lo), r);
+    __m512d p = _mm512_set1_pd(coefs[0u]);
+    for (size_t i=1u; i<14u; ++i) {
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(coefs[i]));
+    }
+    __m512i bits = _mm512_cvtepi32_epi64(_mm512_cvtpd_epi32(k));
+    bits = _mm512_slli_epi64(_mm512_add_epi64(bits, _mm512_set1_epi64(1023)), 52);
+    p = _mm512_mul_pd(p, _mm512_castsi512_pd(bits));
+    return _mm512_maskz_mov_pd(static_cast<__mmask8>(~underflow), p);
+}
+
+__attribute__((target("avx512f")))
+double sum_exp_avx512(const double* x, const size_t n, const double shift) {
+    const __m512d vshift = _mm512_set1_pd(shift);
+    __m512d acc = _mm512_setzero_pd();
+    size_t i = 0u;
+    for (; i + 8u <= n; i += 8u) {
+        acc = _mm512_add_pd(acc, exp_avx512(_mm512_sub_pd(_mm512_loadu_pd(x + i), vshift)));
+    }
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, acc);
+    double sum = ((lanes[0u] + lanes[1u]) + (lanes[2u] + lanes[3u]))
+               + ((lanes[4u] + lanes[5u]) + (lanes[6u] + lanes[7u]));
+    return sum + sum_exp_scalar(x + i, n - i, shift);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // LIKELIGRID_X86
+
+struct Kernel {
+    double (*function)(const double*, size_t, double);
+    const char* isa;
+};
+
+Kernel select_kernel() {
+#ifdef LIKELIGRID_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return {sum_exp_avx512, "avx512f"};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return {sum_exp_avx2, "avx2"};
+#endif
+    return {sum_exp_scalar, "scalar"};
+}
+
+const Kernel& kernel() {
+    static const Kernel selected = select_kernel();
+    return selected;
+}
+
+} // namespace
+
+double sum_exp(const double* x, const size_t n, const double shift) {
+    return kernel().function(x, n, shift);
+}
+
+const char* sum_exp_isa() {
+    return kernel().isa;
+}
+
+} // namespace likeligrid
@@ -0,0 +1,62 @@
+/*! @file logsumexp.hpp
+    @brief Streaming log-sum-exp accumulator
+*/
+#pragma once
+#ifndef LIKELIGRID_LOGSUMEXP_HPP_
+#define LIKELIGRID_LOGSUMEXP_HPP_
+
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace likeligrid {
+
+//! Sum of exp(x[i] - shift) for x[i] <= shift; vectorized if the CPU supports it
+double sum_exp(const double* x, size_t n, double shift);
+//! Instruction set selected for sum_exp() at runtime
+const char* sum_exp_isa();
+
+/*! @brief Log of the sum of exp(x) without a transcendental call per term
+
+    Values are buffered and reduced in blocks by sum_exp()
+    into a linear sum scaled by the running max,
+    which is rescaled only when a block raises the max.
+*/
+class LogSumExp {
+  public:
+    void push(const double x) {
+        if (x == -std::numeric_limits<double>::infinity()) return;
+        buffer_[size_++] = x;
+        if (size_ == block_size) flush();
+    }
+    //! Log of the sum; -inf if empty
+    double result() {
+        flush();
+        if (sum_ == 0.0) return -std::numeric_limits<double>::infinity();
+        return max_ + std::log(sum_);
+    }
+
+  private:
+    static constexpr size_t block_size = 64u;
+
+    void flush() {
+        if (size_ == 0u) return;
+        const double block_max = *std::max_element(buffer_, buffer_ + size_);
+        if (block_max > max_) {
+            sum_ *= std::exp(max_ - block_max);
+            max_ = block_max;
+        }
+        sum_ += sum_exp(buffer_, size_, max_);
+        size_ = 0u;
+    }
+
+    double buffer_[block_size];
+    size_t size_ = 0u;
+    double max_ = -std::numeric_limits<double>::max();
+    double sum_ = 0.0;
+};
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_LOGSUMEXP_HPP_
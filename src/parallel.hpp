@@ -0,0 +1,89 @@
+/*! @file parallel.hpp
+    @brief Work-stealing parallel loop
+*/
+#pragma once
+#ifndef LIKELIGRID_PARALLEL_HPP_
+#define LIKELIGRID_PARALLEL_HPP_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+namespace likeligrid {
+
+/*! @brief Call `fn(i)` for every `i` in `[0, n)` using `concurrency` threads
+
+    Each thread owns a contiguous block of indices and takes them from the front.
+    An idle thread steals single indices from the back of the other blocks.
+    The calling thread works as one of the threads.
+    Results should be stored by index and reduced in index order by the caller
+    so that they do not depend on scheduling.
+    The first exception thrown by `fn` is rethrown after all threads finish.
+*/
+template <class Function> inline void
+parallel_for(const size_t n, const unsigned int concurrency, Function&& fn) {
+    const size_t num_threads = std::min(static_cast<size_t>(concurrency), n);
+    if (num_threads < 2u) {
+        for (size_t i=0u; i<n; ++i) fn(i);
+        return;
+    }
+    struct Block {
+        std::mutex mtx;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<Block> blocks(num_threads);
+    for (size_t t=0u; t<num_threads; ++t) {
+        blocks[t].begin = n * t / num_threads;
+        blocks[t].end = n * (t + 1u) / num_threads;
+    }
+    auto pop_front = [&blocks](const size_t t, size_t* i) {
+        std::lock_guard<std::mutex> lock(blocks[t].mtx);
+        if (blocks[t].begin == blocks[t].end) return false;
+        *i = blocks[t].begin++;
+        return true;
+    };
+    auto pop_back = [&blocks](const size_t t, size_t* i) {
+        std::lock_guard<std::mutex> lock(blocks[t].mtx);
+        if (blocks[t].begin == blocks[t].end) return false;
+        *i = --blocks[t].end;
+        return true;
+    };
+    std::atomic<bool> failed(false);
+    std::exception_ptr exception;
+    std::mutex exception_mtx;
+    auto worker = [&](const size_t t) {
+        size_t i = 0u;
+        while (!failed.load()) {
+            bool found = pop_front(t, &i);
+            for (size_t k=1u; !found && k<num_threads; ++k) {
+                found = pop_back((t + k) % num_threads, &i);
+            }
+            if (!found) return;
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(exception_mtx);
+                if (!exception) exception = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1u);
+    for (size_t t=1u; t<num_threads; ++t) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0u);
+    for (auto& thr: threads) {
+        thr.join();
+    }
+    if (exception) std::rethrow_exception(exception);
+}
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_PARALLEL_HPP_
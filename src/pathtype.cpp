@@ -82,13 +82,95 @@ PathtypeModel::PathtypeModel(std::istream&& ist, const size_t max_sites) {HERE;
 double PathtypeModel::calc_loglik(const std::valarray<double>& th_path) const {
     const size_t max_sites = nsam_with_s_.size() - 1u;
     double loglik = (a_pathway_ * std::log(th_path)).sum();
-    // D = 1.0 when s < 2
+    if (engine_ == Engine::bruteforce) {
+        // D = 1.0 when s < 2
+        for (size_t s=2u; s<=max_sites; ++s) {
+            loglik -= nsam_with_s_[s] * std::log(calc_denom(w_pathway_, th_path, s));
+        }
+    } else {
+        const auto denoms = calc_denoms(th_path, nullptr);
+        for (size_t s=2u; s<=max_sites; ++s) {
+            loglik -= nsam_with_s_[s] * std::log(denoms[s]);
+        }
+    }
+    return loglik += lnp_const_;
+}
+
+double PathtypeModel::calc_loglik_and_gradient(
+    const std::valarray<double>& th_path,
+    std::valarray<double>* gradient) const {
+    if (engine_ != Engine::polynomial) {
+        throw std::runtime_error("gradient is implemented only in Engine::polynomial");
+    }
+    const size_t max_sites = nsam_with_s_.size() - 1u;
+    std::vector<std::vector<double>> d_denoms;
+    const auto denoms = calc_denoms(th_path, &d_denoms);
+    double loglik = (a_pathway_ * std::log(th_path)).sum();
+    *gradient = a_pathway_ / th_path;
     for (size_t s=2u; s<=max_sites; ++s) {
-        loglik -= nsam_with_s_[s] * std::log(calc_denom(w_pathway_, th_path, s));
+        loglik -= nsam_with_s_[s] * std::log(denoms[s]);
+        for (size_t k=0u; k<th_path.size(); ++k) {
+            (*gradient)[k] -= nsam_with_s_[s] * d_denoms[k][s] / denoms[s];
+        }
     }
     return loglik += lnp_const_;
 }
 
+// A pathway hit c times contributes w^c th^(c-1),
+// and the number of sequences with counts (c_j) is s! / prod_j c_j!, so that
+// D_s = s! [x^s] prod_j (1 + sum_{c>=1} w_j^c th_j^(c-1) x^c / c!).
+// The derivatives are multiplied through the same product.
+std::vector<double> PathtypeModel::calc_denoms(
+    const std::valarray<double>& th_pathway,
+    std::vector<std::vector<double>>* d_denoms) const {
+    const size_t max_sites = nsam_with_s_.size() - 1u;
+    const size_t num_pathways = w_pathway_.size();
+    std::vector<double> poly(max_sites + 1u, 0.0);
+    std::vector<double> factor(max_sites + 1u, 1.0);
+    std::vector<double> d_factor(max_sites + 1u, 0.0);
+    poly[0u] = 1.0;
+    if (d_denoms) {
+        d_denoms->assign(num_pathways, std::vector<double>(max_sites + 1u, 0.0));
+    }
+    for (size_t j=0u; j<num_pathways; ++j) {
+        const double w = w_pathway_[j];
+        if (max_sites > 0u) factor[1u] = w;
+        for (size_t c=2u; c<=max_sites; ++c) {
+            factor[c] = factor[c - 1u] * w * th_pathway[j] / c;
+            d_factor[c] = factor[c] * (c - 1u) / th_pathway[j];
+        }
+        for (size_t d=max_sites; d>0u; --d) {
+            if (d_denoms) {
+                for (size_t k=0u; k<num_pathways; ++k) {
+                    auto& d_poly = (*d_denoms)[k];
+                    if (k == j) {
+                        // d_poly[j] is zero before theta_j appears
+                        for (size_t c=2u; c<=d; ++c) {
+                            d_poly[d] += poly[d - c] * d_factor[c];
+                        }
+                    } else {
+                        for (size_t c=1u; c<=d; ++c) {
+                            d_poly[d] += d_poly[d - c] * factor[c];
+                        }
+                    }
+                }
+            }
+            for (size_t c=1u; c<=d; ++c) {
+                poly[d] += poly[d - c] * factor[c];
+            }
+        }
+    }
+    double factorial = 1.0;
+    for (size_t s=1u; s<=max_sites; ++s) {
+        factorial *= s;
+        poly[s] *= factorial;
+        if (d_denoms) {
+            for (auto& d_poly: *d_denoms) {d_poly[s] *= factorial;}
+        }
+    }
+    return poly;
+}
+
 double PathtypeModel::calc_denom(
     const std::valarray<double>& w_pathway,
     const std::valarray<double>& th_pathway,
@@ -97,7 +179,7 @@ double PathtypeModel::calc_denom(
     if (num_mutations < 2u) return 1.0;
     auto iter = wtl::itertools::product(index_axes_[num_mutations]);
     double sum_prob = 0.0;
-    std::bitset<128> bits(th_pathway.size());
+    std::bitset<128> bits;
 
     for (const auto& indices: iter()) {
         double p = 1.0;
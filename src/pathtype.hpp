@@ -14,6 +14,12 @@ namespace likeligrid {
 
 class PathtypeModel {
   public:
+    //! Algorithms to calculate the denominators
+    enum class Engine {
+        polynomial,  //!< exponential generating function in O(K s^2)
+        bruteforce   //!< enumeration of K^s pathway sequences (reference)
+    };
+
     PathtypeModel() = default;
     PathtypeModel(std::istream&&, size_t max_sites);
     PathtypeModel(
@@ -21,14 +27,22 @@ class PathtypeModel {
         size_t max_sites=255u);
 
     double calc_loglik(const std::valarray<double>& th_path) const;
+    //! Evaluate d loglik / d th_path as well; only with Engine::polynomial
+    double calc_loglik_and_gradient(const std::valarray<double>& th_path,
+                                    std::valarray<double>* gradient) const;
     const std::vector<std::string>& names() const {return names_;}
 
+    void set_engine(Engine engine) {engine_ = engine;}
+
     /////1/////////2/////////3/////////4/////////5/////////6/////////7/////////
   private:
     double calc_denom(
         const std::valarray<double>& w_pathway,
         const std::valarray<double>& th_pathway,
         size_t num_mutations) const;
+    std::vector<double> calc_denoms(
+        const std::valarray<double>& th_pathway,
+        std::vector<std::vector<double>>* d_denoms) const;
 
     std::vector<std::string> names_;
     std::valarray<double> w_pathway_;
@@ -36,6 +50,7 @@ class PathtypeModel {
     std::vector<size_t> nsam_with_s_;
     double lnp_const_ = 0.0;
     std::vector<std::vector<std::vector<size_t>>> index_axes_;
+    Engine engine_ = Engine::polynomial;
 };
 
 } // namespace likeligrid
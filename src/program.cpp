@@ -7,6 +7,8 @@
 #include "genotype.hpp"
 #include "gridsearch.hpp"
 #include "gradient_descent.hpp"
+#include "columnar.hpp"
+#include "samples.hpp"
 
 #include <wtl/exception.hpp>
 #include <wtl/debug.hpp>
@@ -14,8 +16,10 @@
 #include <wtl/chrono.hpp>
 #include <wtl/zlib.hpp>
 #include <wtl/filesystem.hpp>
+#include <wtl/scope.hpp>
 #include <clippson/clippson.hpp>
 
+#include <fstream>
 #include <regex>
 
 namespace likeligrid {
@@ -31,7 +35,9 @@ inline clipp::group general_options(nlohmann::json* vm) {
       wtl::option(vm, {"h", "help"}, false, "print this help"),
       wtl::option(vm, {"version"}, false, "print version"),
       wtl::option(vm, {"v", "verbose"}, false, "verbose output"),
-      wtl::option(vm, {"test"}, false, "run tests")
+      wtl::option(vm, {"test"}, false, "run tests"),
+      wtl::option(vm, {"to-tsv"}, false, "convert binary results to TSV"),
+      wtl::option(vm, {"pack"}, false, "convert genotype JSON to *.packed in the current directory")
     ).doc("General:");
 }
 
@@ -41,8 +47,20 @@ inline clipp::group program_options(nlohmann::json* vm) {
       wtl::option(vm, {"j", "parallel"}, 1u),
       wtl::option(vm, {"s", "max-sites"}, 3u),
       wtl::option(vm, {"g", "gradient"}, false),
+      wtl::option(vm, {"lbfgs"}, false),
+      wtl::option(vm, {"async"}, false),
       wtl::option(vm, {"e", "epistasis"}, EPISTASIS_PAIR),
-      wtl::option(vm, {"p", "pleiotropy"}, false)
+      wtl::option(vm, {"p", "pleiotropy"}, false),
+      wtl::option(vm, {"all-pairs"}, false),
+      wtl::option(vm, {"engine"}, std::string("auto")),
+      wtl::option(vm, {"format"}, std::string("tsv")),
+      wtl::option(vm, {"adaptive"}, false),
+      wtl::option(vm, {"bisect"}, false),
+      wtl::option(vm, {"prefilter"}, 0.0),
+      wtl::option(vm, {"cache"}, std::string("")),
+      wtl::option(vm, {"queue"}, std::string("")),
+      wtl::option(vm, {"lease"}, 60.0),
+      wtl::option(vm, {"worker"}, false)
     ).doc("Program:");
 }
 
@@ -73,6 +91,8 @@ Program::Program(const std::vector<std::string>& arguments) {HERE;
         throw wtl::ExitSuccess();
     }
     WTL_ASSERT(VM.at("epistasis").size() == 2u);
+    WTL_ASSERT(!VM.at("lbfgs") || VM.at("gradient"));
+    WTL_ASSERT(!VM.at("async") || (VM.at("gradient") && !VM.at("lbfgs")));
     if (vm_local["verbose"]) {
         std::cerr << wtl::iso8601datetime() << std::endl;
         std::cerr << VM.dump(2) << std::endl;
@@ -84,6 +104,43 @@ Program::Program(const std::vector<std::string>& arguments) {HERE;
         model.benchmark(VM.at("parallel"));
         throw wtl::ExitSuccess();
     }
+    if (vm_local["to-tsv"]) {
+        for (const std::string infile: VM.at("--")) {
+            write_tsv(ColumnarReader(infile), std::cout);
+        }
+        throw wtl::ExitSuccess();
+    }
+    if (vm_local["pack"]) {
+        for (const std::string infile: VM.at("--")) {
+            // the prefix is extracted from *.json.packed as from *.json
+            const std::string outfile = fs::path(infile).filename().string() + ".packed";
+            std::cerr << "Writing: " << outfile << std::endl;
+            wtl::zlib::ifstream ist(infile);
+            std::ofstream ost(outfile, std::ios::binary);
+            pack_samples(ist, ost);
+        }
+        throw wtl::ExitSuccess();
+    }
+}
+
+inline GridSearch::Format grid_format(const std::string& name) {
+    if (name == "tsv") return GridSearch::Format::tsv;
+    if (name == "binary") return GridSearch::Format::binary;
+    if (name == "zlib") return GridSearch::Format::binary_zlib;
+    throw std::runtime_error("unknown --format: " + name);
+}
+
+//! Apply --engine unless it is "auto", in which the model chooses by memory
+template <class Searcher>
+inline void configure_engine(Searcher& searcher) {
+    const std::string name = VM.at("engine");
+    if (name == "dp") {
+        searcher.set_engine(GenotypeModel::Engine::dp);
+    } else if (name == "recursion") {
+        searcher.set_engine(GenotypeModel::Engine::recursion);
+    } else if (name != "auto") {
+        throw std::runtime_error("unknown --engine: " + name);
+    }
 }
 
 inline std::string extract_prefix(const std::string& infile) {
@@ -101,14 +158,13 @@ inline std::string extract_prefix(const std::string& infile) {
     throw std::runtime_error("Cannot extract prefix: " + infile);
 }
 
-inline std::string make_outdir(const std::string& prefix) {
-    const std::vector<size_t> epistasis_pair = VM.at("epistasis");
+inline std::string make_outdir(const std::string& prefix, const std::pair<size_t, size_t>& epistasis_pair) {
     std::ostringstream oss;
     oss << prefix << "-s" << VM.at("max-sites");
     if (VM.at("gradient")) {oss << "-g";}
-    if (epistasis_pair[0u] != epistasis_pair[1u]) {
-        oss << "-e" << epistasis_pair[0u]
-            <<  "x" << epistasis_pair[1u];
+    if (epistasis_pair.first != epistasis_pair.second) {
+        oss << "-e" << epistasis_pair.first
+            <<  "x" << epistasis_pair.second;
     }
     if (VM.at("pleiotropy")) {oss << "-p";}
     const std::string outdir = oss.str();
@@ -116,6 +172,63 @@ inline std::string make_outdir(const std::string& prefix) {
     return outdir;
 }
 
+//! Apply the search options shared by all modes
+inline void configure(GridSearch& searcher) {
+    const std::string cache_dir = VM.at("cache");
+    const std::string queue_dir = VM.at("queue");
+    configure_engine(searcher);
+    searcher.set_format(grid_format(VM.at("format")));
+    searcher.set_adaptive(VM.at("adaptive"));
+    searcher.set_bisection(VM.at("bisect"));
+    searcher.set_prefilter(VM.at("prefilter"));
+    if (!cache_dir.empty()) searcher.set_cache(cache_dir);
+    if (!queue_dir.empty()) searcher.set_queue(queue_dir, VM.at("lease"));
+}
+
+//! Apply the search options shared by all modes
+inline void configure(GradientDescent& searcher) {
+    const std::string cache_dir = VM.at("cache");
+    configure_engine(searcher);
+    searcher.set_method(VM.at("lbfgs") ? GradientDescent::Method::lbfgs : GradientDescent::Method::lattice);
+    searcher.set_asynchronous(VM.at("async"));
+    if (!cache_dir.empty()) searcher.set_cache(cache_dir);
+}
+
+inline void run_to_file(GradientDescent& searcher, const std::string& outdir) {
+    const auto outfile = fs::path(outdir) / searcher.outfile();
+    std::cerr << "outfile: " << outfile << std::endl;
+    wtl::zlib::ofstream ost(outfile.native());
+    ost.precision(std::cout.precision());
+    searcher.run(ost);
+}
+
+// The dataset is loaded once and shared by the models of all pairs,
+// and each pair is written to its usual directory.
+inline void run_all_pairs(const std::string& infile, const size_t max_sites,
+                          const bool pleiotropy, const unsigned int concurrency) {HERE;
+    const GenotypeModel model(infile, max_sites);
+    const std::string prefix = extract_prefix(infile);
+    const size_t num_pathways = model.names().size();
+    for (size_t i=0u; i<num_pathways; ++i) {
+        for (size_t j=i + 1u; j<num_pathways; ++j) {
+            const std::pair<size_t, size_t> epistasis{i, j};
+            const std::string outdir = make_outdir(prefix, epistasis);
+            if (VM.at("gradient")) {
+                GradientDescent searcher(model, epistasis, pleiotropy, concurrency);
+                configure(searcher);
+                run_to_file(searcher, outdir);
+                continue;
+            }
+            GridSearch searcher(model, epistasis, pleiotropy, concurrency);
+            configure(searcher);
+            const auto origin = fs::current_path();
+            auto at_exit = wtl::scope_exit([&origin](){fs::current_path(origin);});
+            fs::current_path(outdir);
+            searcher.run(true);
+        }
+    }
+}
+
 void Program::run() {HERE;
     const unsigned concurrency = VM.at("parallel");
     const unsigned max_sites = VM.at("max-sites");
@@ -123,27 +236,36 @@ void Program::run() {HERE;
     const std::string infile = VM.at("--")[0u];
     const std::pair<size_t, size_t> epistasis{VM.at("epistasis")[0u], VM.at("epistasis")[1u]};
     WTL_ASSERT(!pleiotropy || (epistasis.first != epistasis.second));
+    const std::string queue_dir = VM.at("queue");
+    WTL_ASSERT(!VM.at("worker") || !queue_dir.empty());
+    WTL_ASSERT(!VM.at("all-pairs") || (epistasis.first == epistasis.second && !VM.at("worker") && infile != "-"));
     try {
-        if (VM.at("gradient")) {
+        if (VM.at("all-pairs")) {
+            run_all_pairs(infile, max_sites, pleiotropy, concurrency);
+        } else if (VM.at("gradient")) {
             if (infile == "-") {
                 GradientDescent searcher(std::cin, max_sites, epistasis, pleiotropy, concurrency);
+                configure(searcher);
                 searcher.run(std::cout);
                 return;
             }
             GradientDescent searcher(infile, max_sites, epistasis, pleiotropy, concurrency);
-            const auto outdir = make_outdir(extract_prefix(infile));
-            const auto outfile = fs::path(outdir) / searcher.outfile();
-            std::cerr << "outfile: " << outfile << std::endl;
-            wtl::zlib::ofstream ost(outfile.native());
-            ost.precision(std::cout.precision());
-            searcher.run(ost);
+            configure(searcher);
+            run_to_file(searcher, make_outdir(extract_prefix(infile), epistasis));
+        } else if (VM.at("worker")) {
+            GridSearch searcher(infile, max_sites, epistasis, pleiotropy, concurrency);
+            configure_engine(searcher);
+            searcher.set_queue(queue_dir, VM.at("lease"));
+            searcher.work();
         } else if (infile == "-") {
             GridSearch searcher(std::cin, max_sites, epistasis, pleiotropy, concurrency);
+            configure(searcher);
             searcher.run(false);
         } else {
             GridSearch searcher(infile, max_sites, epistasis, pleiotropy, concurrency);
+            configure(searcher);
             // after constructor success
-            const std::string outdir = make_outdir(extract_prefix(infile));
+            const std::string outdir = make_outdir(extract_prefix(infile), epistasis);
             fs::current_path(outdir);
             searcher.run(true);
         }
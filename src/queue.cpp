@@ -0,0 +1,241 @@
+/*! @file queue.cpp
+    @brief Implementation of WorkQueue class
+*/
+#include "queue.hpp"
+
+#include <wtl/debug.hpp>
+#include <wtl/filesystem.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <tuple>
+
+namespace likeligrid {
+
+namespace fs = wtl::filesystem;
+
+namespace {
+
+//! Write to a temporary file and rename it
+void write_atomic(const std::string& path, const std::string& id, const std::string& content) {
+    const std::string tmp = path + "." + id + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::binary);
+        ofs.write(content.data(), static_cast<std::streamsize>(content.size()));
+        if (!ofs) throw std::runtime_error("cannot write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+}
+
+//! Split "<job>.<begin>.<state>"; false if the name is not of a chunk
+bool parse_chunk(const std::string& name, std::string* job, size_t* begin, std::string* state) {
+    const size_t first = name.find('.');
+    const size_t last = name.rfind('.');
+    if (first == std::string::npos || first == last) return false;
+    const std::string digits = name.substr(first + 1u, last - first - 1u);
+    if (digits.empty() || digits.find_first_not_of("0123456789") != std::string::npos) return false;
+    *job = name.substr(0u, first);
+    *begin = std::stoul(digits);
+    *state = name.substr(last + 1u);
+    return true;
+}
+
+} // namespace
+
+WorkQueue::WorkQueue(const std::string& dir, const double lease)
+: dir_(fs::absolute(dir).string()), lease_(lease) {HERE;
+    fs::create_directories(dir_);
+    char host[256] = {};
+    ::gethostname(host, sizeof(host) - 1u);
+    id_ = host;
+    // '.' separates the fields of file names
+    std::replace(id_.begin(), id_.end(), '.', '_');
+    id_ += "-" + std::to_string(::getpid());
+}
+
+std::string WorkQueue::post(const std::string& fingerprint,
+                            const std::vector<std::valarray<double>>& axes,
+                            const size_t chunk_size) {HERE;
+    size_t max_count = 1u;
+    for (const auto& axis: axes) {max_count *= axis.size();}
+    const std::string job = id_ + "-" + std::to_string(num_posted_++);
+    std::ostringstream oss;
+    oss.precision(std::numeric_limits<double>::max_digits10);
+    oss << fingerprint << "\n" << max_count << "\t" << chunk_size << "\n" << axes.size() << "\n";
+    for (const auto& axis: axes) {
+        oss << axis.size();
+        for (const double x: axis) {oss << "\t" << x;}
+        oss << "\n";
+    }
+    write_atomic(path(job + ".job"), id_, oss.str());
+    jobs_[job] = Job{fingerprint, max_count, chunk_size, axes};
+    return job;
+}
+
+void WorkQueue::put(const std::string& job, const size_t begin) const {
+    const std::string todo = chunk_path(job, begin, "todo");
+    if (!std::ofstream(todo)) throw std::runtime_error("cannot write " + todo);
+}
+
+bool WorkQueue::take(const std::string& job, const size_t begin, std::vector<double>* logliks) {
+    const std::string done = chunk_path(job, begin, "done");
+    std::ifstream ifs(done, std::ios::binary);
+    if (!ifs) return false;
+    const Job& posted = jobs_.at(job);
+    const size_t end = std::min(begin + posted.chunk_size, posted.max_count);
+    logliks->resize(end - begin);
+    const auto bytes = static_cast<std::streamsize>(logliks->size() * sizeof(double));
+    ifs.read(reinterpret_cast<char*>(logliks->data()), bytes);
+    if (ifs.gcount() != bytes) throw std::runtime_error("truncated " + done);
+    ifs.close();
+    std::remove(done.c_str());
+    // left by a worker whose claim expired while it was finishing
+    std::remove(chunk_path(job, begin, "todo").c_str());
+    std::remove(chunk_path(job, begin, "claimed").c_str());
+    return true;
+}
+
+void WorkQueue::close(const std::string& job) {HERE;
+    std::remove(path(job + ".job").c_str());
+    const std::string prefix = job + ".";
+    for (const auto& entry: fs::directory_iterator(dir_)) {
+        const std::string name = entry.path().filename().string();
+        if (name.compare(0u, prefix.size(), prefix) == 0) {
+            std::remove(entry.path().string().c_str());
+        }
+    }
+    jobs_.erase(job);
+}
+
+bool WorkQueue::claim(const std::string& job, const size_t begin) {
+    const std::string claimed = chunk_path(job, begin, "claimed");
+    if (std::rename(chunk_path(job, begin, "todo").c_str(), claimed.c_str()) != 0) return false;
+    // rename() keeps the time of the todo file
+    ::utime(claimed.c_str(), nullptr);
+    return true;
+}
+
+// The chunk with the smallest begin is claimed first
+// so that the coordinator consuming in order waits less.
+bool WorkQueue::claim_any(const std::string& fingerprint, Chunk* chunk) {
+    requeue();
+    evict();
+    std::vector<std::pair<std::string, size_t>> candidates;
+    std::string job, state;
+    size_t begin = 0u;
+    for (const auto& entry: fs::directory_iterator(dir_)) {
+        if (!parse_chunk(entry.path().filename().string(), &job, &begin, &state)) continue;
+        if (state == "todo") candidates.emplace_back(job, begin);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+        [](const std::pair<std::string, size_t>& lhs, const std::pair<std::string, size_t>& rhs) {
+            return std::tie(lhs.second, lhs.first) < std::tie(rhs.second, rhs.first);
+        });
+    for (const auto& candidate: candidates) {
+        const Job* posted = read_job(candidate.first);
+        if (!posted || posted->fingerprint != fingerprint) continue;
+        if (!claim(candidate.first, candidate.second)) continue;
+        chunk->job = candidate.first;
+        chunk->begin = candidate.second;
+        chunk->end = std::min(chunk->begin + posted->chunk_size, posted->max_count);
+        chunk->axes = &posted->axes;
+        return true;
+    }
+    return false;
+}
+
+void WorkQueue::touch(const std::string& job, const size_t begin) const {
+    ::utime(chunk_path(job, begin, "claimed").c_str(), nullptr);
+}
+
+void WorkQueue::touch(const std::string& job) const {
+    ::utime(path(job + ".job").c_str(), nullptr);
+}
+
+void WorkQueue::complete(const std::string& job, const size_t begin, const std::vector<double>& logliks) {
+    const std::string claimed = chunk_path(job, begin, "claimed");
+    if (::access(path(job + ".job").c_str(), F_OK) == 0) {
+        const std::string bytes(reinterpret_cast<const char*>(logliks.data()), logliks.size() * sizeof(double));
+        write_atomic(chunk_path(job, begin, "done"), id_, bytes);
+    }
+    std::remove(claimed.c_str());
+}
+
+void WorkQueue::requeue() const {
+    std::string job, state;
+    size_t begin = 0u;
+    for (const auto& entry: fs::directory_iterator(dir_)) {
+        if (!parse_chunk(entry.path().filename().string(), &job, &begin, &state)) continue;
+        if (state != "claimed" || !expired(entry.path().string())) continue;
+        std::cerr << "requeue: " << entry.path().filename().string() << std::endl;
+        std::rename(entry.path().string().c_str(), chunk_path(job, begin, "todo").c_str());
+    }
+}
+
+bool WorkQueue::busy() const {
+    for (const auto& entry: fs::directory_iterator(dir_)) {
+        if (entry.path().extension() == ".job" && !expired(entry.path().string())) return true;
+    }
+    return false;
+}
+
+std::string WorkQueue::path(const std::string& name) const {
+    return (fs::path(dir_) / name).string();
+}
+
+std::string WorkQueue::chunk_path(const std::string& job, const size_t begin, const char* state) const {
+    return path(job + "." + std::to_string(begin) + "." + state);
+}
+
+const WorkQueue::Job* WorkQueue::read_job(const std::string& job) {
+    const std::string job_path = path(job + ".job");
+    if (expired(job_path)) return nullptr;
+    auto it = jobs_.find(job);
+    if (it != jobs_.end()) return &it->second;
+    std::ifstream ifs(job_path);
+    Job posted;
+    size_t num_axes = 0u;
+    ifs >> posted.fingerprint >> posted.max_count >> posted.chunk_size >> num_axes;
+    for (size_t j=0u; j<num_axes && ifs; ++j) {
+        size_t size = 0u;
+        ifs >> size;
+        std::valarray<double> axis(size);
+        for (auto& x: axis) {ifs >> x;}
+        posted.axes.push_back(std::move(axis));
+    }
+    if (!ifs) return nullptr;
+    return &(jobs_[job] = std::move(posted));
+}
+
+// The axes of a chunk stay valid until the next claim_any().
+void WorkQueue::evict() {
+    for (auto it = jobs_.begin(); it != jobs_.end();) {
+        if (expired(path(it->first + ".job"))) {
+            it = jobs_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool WorkQueue::expired(const std::string& path) const {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return true;
+    return std::difftime(std::time(nullptr), st.st_mtime) > lease_;
+}
+
+} // namespace likeligrid
@@ -0,0 +1,94 @@
+/*! @file queue.hpp
+    @brief Interface of WorkQueue class
+*/
+#pragma once
+#ifndef LIKELIGRID_QUEUE_HPP_
+#define LIKELIGRID_QUEUE_HPP_
+
+#include <string>
+#include <vector>
+#include <valarray>
+#include <map>
+
+namespace likeligrid {
+
+/*! @brief Chunks of grids shared by processes through a directory
+
+    A coordinator posts a job as "<job>.job" holding the fingerprint of the model,
+    the number of points, the chunk size, and the axes of the product,
+    and a "<job>.<begin>.todo" file for each chunk of points put so far.
+    A process claims a chunk by renaming it to "<job>.<begin>.claimed",
+    touches it while evaluating, and publishes loglik as doubles
+    by renaming a temporary file to "<job>.<begin>.done".
+    Renaming is atomic within a directory, also on shared filesystems.
+
+    Claims untouched for `lease` seconds are renamed back to todo,
+    so that the chunks of crashed workers are evaluated again.
+    Jobs untouched for `lease` seconds are ignored as abandoned.
+    Clocks of the hosts are assumed to agree within the lease.
+*/
+class WorkQueue {
+  public:
+    struct Chunk {
+        std::string job;
+        size_t begin;
+        size_t end;
+        const std::vector<std::valarray<double>>* axes;
+    };
+
+    WorkQueue(const std::string& dir, double lease=60.0);
+
+    //! Post the product of axes without chunks; return the job name
+    std::string post(const std::string& fingerprint,
+                     const std::vector<std::valarray<double>>& axes,
+                     size_t chunk_size);
+    //! Make the chunk from `begin` todo
+    void put(const std::string& job, size_t begin) const;
+    //! Set loglik of a chunk and remove it if done
+    bool take(const std::string& job, size_t begin, std::vector<double>* logliks);
+    //! Remove the files of a job
+    void close(const std::string& job);
+
+    //! Claim a chunk if it is todo
+    bool claim(const std::string& job, size_t begin);
+    //! Claim a chunk of any live job for the fingerprint
+    bool claim_any(const std::string& fingerprint, Chunk* chunk);
+    //! Extend the lease of a claimed chunk
+    void touch(const std::string& job, size_t begin) const;
+    //! Extend the lease of a posted job
+    void touch(const std::string& job) const;
+    //! Publish loglik of a claimed chunk
+    void complete(const std::string& job, size_t begin, const std::vector<double>& logliks);
+    //! Return expired claims to todo
+    void requeue() const;
+    //! True if any live job exists
+    bool busy() const;
+    double lease() const {return lease_;}
+
+  private:
+    struct Job {
+        std::string fingerprint;
+        size_t max_count;
+        size_t chunk_size;
+        std::vector<std::valarray<double>> axes;
+    };
+
+    std::string path(const std::string& name) const;
+    std::string chunk_path(const std::string& job, size_t begin, const char* state) const;
+    //! Read a job file once; nullptr if it is gone or abandoned
+    const Job* read_job(const std::string& job);
+    //! Forget the jobs that are closed or abandoned
+    void evict();
+    bool expired(const std::string& path) const;
+
+    const std::string dir_;
+    const double lease_;
+    //! unique among the processes sharing the directory
+    std::string id_;
+    size_t num_posted_ = 0u;
+    std::map<std::string, Job> jobs_;
+};
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_QUEUE_HPP_
@@ -0,0 +1,282 @@
+/*! @file samples.cpp
+    @brief Implementation of streaming genotype readers
+*/
+#include "samples.hpp"
+
+#include <wtl/debug.hpp>
+
+#include <clippson/json.hpp>
+
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <map>
+#include <stdexcept>
+
+namespace likeligrid {
+
+namespace {
+
+constexpr char magic[8] = {'L', 'G', 'R', 'I', 'D', 'G', 'N', 'T'};
+constexpr uint32_t version = 1u;
+
+//! FNV-1a including a terminating null to separate fields
+inline void hash_combine(uint64_t* digest, const std::string& str) {
+    constexpr uint64_t prime = 1099511628211ull;
+    for (const char c: str) {
+        *digest = (*digest ^ static_cast<unsigned char>(c)) * prime;
+    }
+    *digest *= prime;
+}
+
+inline void write_uint32(std::ostream& ost, const size_t x) {
+    const uint32_t value = static_cast<uint32_t>(x);
+    ost.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void write_string(std::ostream& ost, const std::string& str) {
+    write_uint32(ost, str.size());
+    ost.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+//! Return false at the end of input; throw if truncated
+inline bool read_uint32(std::istream& ist, uint32_t* x) {
+    ist.read(reinterpret_cast<char*>(x), sizeof(*x));
+    if (ist.gcount() == 0) return false;
+    if (ist.gcount() != sizeof(*x)) throw std::runtime_error("truncated packed samples");
+    return true;
+}
+
+inline uint32_t read_uint32(std::istream& ist) {
+    uint32_t x;
+    if (!read_uint32(ist, &x)) throw std::runtime_error("truncated packed samples");
+    return x;
+}
+
+inline std::string read_string(std::istream& ist) {
+    std::string str(read_uint32(ist), '\0');
+    ist.read(&str[0], static_cast<std::streamsize>(str.size()));
+    if (static_cast<size_t>(ist.gcount()) != str.size()) {
+        throw std::runtime_error("truncated packed samples");
+    }
+    return str;
+}
+
+//! Accumulate samples one by one
+class Counter {
+  public:
+    Counter(Samples* samples, const size_t max_sites)
+    : samples_(samples), max_sites_(max_sites) {}
+
+    void set_num_genes(const size_t num_genes) {
+        samples_->num_genes = num_genes;
+        samples_->nsam_with_s.assign(num_genes + 1u, 0u);
+        samples_->s_gene.resize(num_genes, 0.0);
+    }
+    //! Called once before samples
+    void header() {
+        for (const auto& x: samples_->names) hash_combine(&samples_->digest, x);
+        for (const auto& x: samples_->annotation) hash_combine(&samples_->digest, x);
+    }
+    void operator()(const std::string& bits) {
+        if (samples_->nsam_with_s.empty()) set_num_genes(bits.size());
+        if (bits.size() != samples_->num_genes) {
+            throw std::runtime_error("inconsistent length of samples: " + bits);
+        }
+        hash_combine(&samples_->digest, bits);
+        const auto indices = to_indices(bits);
+        const size_t s = indices.size();
+        ++samples_->nsam_with_s[s];
+        if (s > max_sites_) return;
+        auto& genotypes = samples_->genotypes;
+        const auto inserted = index_.emplace(indices, genotypes.size());
+        if (inserted.second) {
+            genotypes.emplace_back(indices, 0u);
+        }
+        ++genotypes[inserted.first->second].second;
+        for (const auto j: indices) {
+            ++samples_->s_gene[j];
+        }
+    }
+
+  private:
+    Samples* samples_;
+    const size_t max_sites_;
+    std::map<std::vector<size_t>, size_t> index_;
+};
+
+/*! @brief SAX handler passing the elements of top-level arrays
+
+    Values of other keys are skipped.
+*/
+class Handler: public nlohmann::json_sax<nlohmann::json> {
+  public:
+    Handler(Samples* samples, std::function<void()> on_header,
+            std::function<void(const std::string&)> on_sample)
+    : samples_(samples), on_header_(on_header), on_sample_(on_sample) {}
+
+    bool null() override {return scalar();}
+    bool boolean(bool) override {return scalar();}
+    bool number_integer(number_integer_t) override {return scalar();}
+    bool number_unsigned(number_unsigned_t) override {return scalar();}
+    bool number_float(number_float_t, const string_t&) override {return scalar();}
+    bool binary(binary_t&) override {return scalar();}
+    bool string(string_t& val) override {
+        if (!in_element()) return true;
+        if (key_ == "pathway") {
+            samples_->names.push_back(val);
+        } else if (key_ == "annotation") {
+            samples_->annotation.push_back(val);
+        } else if (has_header_) {
+            on_sample_(val);
+        } else {
+            pending_.push_back(val);
+        }
+        return true;
+    }
+    bool start_object(std::size_t) override {return open();}
+    bool start_array(std::size_t) override {
+        if (depth_ == 0u) throw std::runtime_error("JSON object expected");
+        return open();
+    }
+    bool key(string_t& val) override {
+        if (depth_ == 1u) {key_ = val;}
+        return true;
+    }
+    bool end_object() override {
+        if (--depth_ > 0u) return true;
+        if (!has_header_) {
+            throw std::runtime_error("\"pathway\" and \"annotation\" are required");
+        }
+        return true;
+    }
+    bool end_array() override {
+        if (--depth_ == 1u) {
+            has_names_ |= (key_ == "pathway");
+            has_annotation_ |= (key_ == "annotation");
+            if (!has_header_ && has_names_ && has_annotation_) {
+                has_header_ = true;
+                on_header_();
+                for (const auto& bits: pending_) {on_sample_(bits);}
+                pending_.clear();
+                pending_.shrink_to_fit();
+            }
+        }
+        return true;
+    }
+    bool parse_error(std::size_t position, const std::string&,
+                     const nlohmann::json::exception& e) override {
+        throw std::runtime_error("JSON parse error at " + std::to_string(position) + ": " + e.what());
+    }
+
+  private:
+    bool in_element() const {
+        return depth_ == 2u && (key_ == "pathway" || key_ == "annotation" || key_ == "sample");
+    }
+    bool scalar() const {
+        if (in_element()) throw std::runtime_error("string expected in \"" + key_ + "\"");
+        return true;
+    }
+    bool open() {
+        scalar();
+        ++depth_;
+        return true;
+    }
+
+    Samples* samples_;
+    std::function<void()> on_header_;
+    std::function<void(const std::string&)> on_sample_;
+    size_t depth_ = 0u;
+    std::string key_;
+    bool has_names_ = false;
+    bool has_annotation_ = false;
+    bool has_header_ = false;
+    std::vector<std::string> pending_;
+};
+
+void read_json(std::istream& ist, Samples* samples, Counter& counter) {
+    Handler handler(samples, [&counter]() {counter.header();}, std::ref(counter));
+    nlohmann::json::sax_parse(ist, &handler);
+}
+
+void read_packed(std::istream& ist, Samples* samples, Counter& counter) {
+    char buffer[sizeof(magic)];
+    ist.read(buffer, sizeof(magic));
+    if (ist.gcount() != sizeof(magic) || !std::equal(magic, magic + sizeof(magic), buffer)
+        || read_uint32(ist) != version) {
+        throw std::runtime_error("incompatible packed samples");
+    }
+    const size_t num_pathways = read_uint32(ist);
+    const size_t num_genes = read_uint32(ist);
+    for (size_t i=0u; i<num_pathways; ++i) {
+        samples->names.push_back(read_string(ist));
+        samples->annotation.push_back(read_string(ist));
+    }
+    counter.header();
+    counter.set_num_genes(num_genes);
+    std::vector<uint32_t> indices;
+    for (uint32_t s = 0u; read_uint32(ist, &s);) {
+        indices.resize(s);
+        ist.read(reinterpret_cast<char*>(indices.data()), static_cast<std::streamsize>(s * sizeof(uint32_t)));
+        if (static_cast<size_t>(ist.gcount()) != s * sizeof(uint32_t)) {
+            throw std::runtime_error("truncated packed samples");
+        }
+        std::string bits(num_genes, '0');
+        for (const auto j: indices) {
+            if (j >= num_genes) throw std::runtime_error("gene index out of range in packed samples");
+            bits[num_genes - 1u - j] = '1';
+        }
+        counter(bits);
+    }
+}
+
+} // namespace
+
+Samples read_samples(std::istream& ist, const size_t max_sites) {HERE;
+    Samples samples;
+    Counter counter(&samples, max_sites);
+    if (ist.peek() == magic[0u]) {
+        read_packed(ist, &samples, counter);
+    } else {
+        read_json(ist, &samples, counter);
+    }
+    if (samples.num_genes == 0u) throw std::runtime_error("no samples");
+    return samples;
+}
+
+void pack_samples(std::istream& json, std::ostream& ost) {HERE;
+    Samples samples;
+    size_t num_genes = 0u;
+    auto write_header = [&]() {
+        ost.write(magic, sizeof(magic));
+        write_uint32(ost, version);
+        write_uint32(ost, samples.names.size());
+        write_uint32(ost, num_genes);
+        for (size_t i=0u; i<samples.names.size(); ++i) {
+            write_string(ost, samples.names[i]);
+            write_string(ost, samples.annotation.at(i));
+        }
+    };
+    std::vector<uint32_t> indices;
+    auto write_sample = [&](const std::string& bits) {
+        if (num_genes == 0u) {
+            num_genes = bits.size();
+            write_header();
+        }
+        if (bits.size() != num_genes || bits.find_first_not_of("01") != std::string::npos) {
+            throw std::runtime_error("invalid sample: " + bits);
+        }
+        indices.clear();
+        for (const auto j: to_indices(bits)) {
+            indices.push_back(static_cast<uint32_t>(j));
+        }
+        write_uint32(ost, indices.size());
+        ost.write(reinterpret_cast<const char*>(indices.data()),
+                  static_cast<std::streamsize>(indices.size() * sizeof(uint32_t)));
+    };
+    Handler handler(&samples, []() {}, write_sample);
+    nlohmann::json::sax_parse(json, &handler);
+    if (num_genes == 0u) throw std::runtime_error("no samples");
+}
+
+} // namespace likeligrid
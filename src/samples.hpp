@@ -0,0 +1,60 @@
+/*! @file samples.hpp
+    @brief Interface of streaming genotype readers
+*/
+#pragma once
+#ifndef LIKELIGRID_SAMPLES_HPP_
+#define LIKELIGRID_SAMPLES_HPP_
+
+#include <iosfwd>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <valarray>
+#include <utility>
+
+namespace likeligrid {
+
+/*! @brief Samples with at most max_sites mutations in a compact form
+
+    JSON input is read as a stream of parse events, so the document is never held:
+    {"pathway": [names], "annotation": [gene bits], "sample": [gene bits]}.
+    Gene bits are strings of '0' and '1' read from the right.
+    Samples appearing before "pathway" and "annotation" are held until both are read.
+
+    The packed format is the same content in binary:
+    magic "LGRIDGNT", uint32 version, uint32 number of pathways,
+    uint32 number of genes, then for each pathway the name and annotation
+    as uint32 length and bytes, then until the end of file,
+    each sample as uint32 number of mutated genes and their uint32 indices.
+*/
+struct Samples {
+    std::vector<std::string> names;
+    std::vector<std::string> annotation;
+    size_t num_genes = 0u;
+    //! number of samples with s mutations, including those not stored
+    std::vector<size_t> nsam_with_s;
+    //! unique genotypes as indices of mutated genes, and the number of samples
+    std::vector<std::pair<std::vector<size_t>, size_t>> genotypes;
+    //! number of stored samples with the mutated gene
+    std::valarray<double> s_gene;
+    //! FNV-1a of pathways, annotation, and samples as gene bits
+    uint64_t digest = 14695981039346656037ull;
+};
+
+//! Read JSON or the packed format
+Samples read_samples(std::istream&, size_t max_sites);
+//! Convert JSON to the packed format
+void pack_samples(std::istream& json, std::ostream&);
+
+//! Indices of '1' from the right
+inline std::vector<size_t> to_indices(const std::string& bits) {
+    std::vector<size_t> indices;
+    for (size_t j=0u; j<bits.size(); ++j) {
+        if (bits[bits.size() - 1u - j] == '1') indices.push_back(j);
+    }
+    return indices;
+}
+
+} // namespace likeligrid
+
+#endif // LIKELIGRID_SAMPLES_HPP_
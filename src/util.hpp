@@ -20,6 +20,8 @@ namespace likeligrid {
 
 constexpr std::array<double, 6> STEPS = {{0.32, 0.16, 0.08, 0.04, 0.02, 0.01}};
 constexpr std::array<size_t, 6> BREAKS = {{5, 5, 5, 5, 5, 5}};
+//! Name of the last column flagging rows with approximate loglik by 1
+constexpr char APPROXIMATE[] = "approximate";
 
 inline std::vector<std::valarray<double>>
 make_vicinity(const std::valarray<double>& center, const size_t breaks, const double radius, const double max=2.001) {
@@ -79,13 +81,23 @@ inline double d2_from_neutral(const std::vector<double>& v) {
     return d;
 }
 
-inline std::tuple<size_t, std::vector<std::string>, std::valarray<double>>
+//! True if the header ends with the APPROXIMATE column
+inline bool has_approximate_column(const std::string& header) {
+    const std::string suffix = std::string("\t") + APPROXIMATE + "\n";
+    return header.size() >= suffix.size()
+        && header.compare(header.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//! Return the number of rows, column names, MLE, and max loglik;
+//! approximate rows are not candidates of MLE
+inline std::tuple<size_t, std::vector<std::string>, std::valarray<double>, double>
 read_body(std::istream& ist) {
     std::string buffer;
     ist >> buffer; // loglik
     std::getline(ist, buffer); // header
     buffer.erase(0u, 1u); // \t
     const std::vector<std::string> colnames = wtl::split(buffer, "\t");
+    const bool marked = !colnames.empty() && colnames.back() == APPROXIMATE;
     size_t nrow = 0u;
     double max_ll = std::numeric_limits<double>::lowest();
     std::vector<double> mle;
@@ -93,19 +105,24 @@ read_body(std::istream& ist) {
         ++nrow;
         std::istringstream iss(buffer);
         std::istream_iterator<double> it(iss);
-        if (wtl::approx(*it, max_ll)) {
-            std::vector<double> chalenger(++it, std::istream_iterator<double>());
+        const double loglik = *it;
+        std::vector<double> chalenger(++it, std::istream_iterator<double>());
+        if (marked) {
+            if (chalenger.back() != 0.0) continue;
+            chalenger.pop_back();
+        }
+        if (wtl::approx(loglik, max_ll)) {
             if (d2_from_neutral(chalenger) < d2_from_neutral(mle)) {
-                max_ll = *it;
+                max_ll = loglik;
                 mle.swap(chalenger);
             }
-        } else if (*it > max_ll) {
-            max_ll = *it;
-            mle.assign(++it, std::istream_iterator<double>());
+        } else if (loglik > max_ll) {
+            max_ll = loglik;
+            mle.swap(chalenger);
         }
     }
     std::valarray<double> mle_params(mle.data(), mle.size());
-    return std::make_tuple(nrow, colnames, mle_params);
+    return std::make_tuple(nrow, colnames, mle_params, max_ll);
 }
 
 inline std::valarray<double>
@@ -0,0 +1,73 @@
+#include "cache.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <iterator>
+#include <string>
+
+int main() {
+    const std::string dir = "test-cache";
+    const std::string path = dir + "/abc.cache";
+    std::remove(path.c_str());
+    {
+        likeligrid::LoglikCache cache(dir, "abc", 2u);
+        cache.insert({0.5, 1.25}, -3.5);
+        cache.insert({0.5, 1.255}, -4.0);  // off the lattice
+        cache.insert({0.5, 1.25}, -9.0);   // existing
+        cache.flush();
+        cache.insert({2.0, 0.01}, -1.0);
+        if (cache.size() != 2u) return 1;
+    }
+    {
+        // a truncated record at the end is ignored
+        std::ofstream ofs(path, std::ios::binary | std::ios::app);
+        ofs << "xyz";
+    }
+    likeligrid::LoglikCache cache(dir, "abc", 2u);
+    std::cerr << cache.path() << ": " << cache.size() << std::endl;
+    if (cache.size() != 2u) return 1;
+    double loglik = 0.0;
+    if (!cache.find({0.5, 1.25}, &loglik) || loglik != -3.5) return 1;
+    if (!cache.find({2.0, 0.01}, &loglik) || loglik != -1.0) return 1;
+    if (cache.find({0.5, 1.255}, &loglik)) return 1;
+    if (cache.find({1.0, 1.0}, &loglik)) return 1;
+    if (cache.hits() != 2u) return 1;
+    // the partial record is truncated before appending
+    cache.insert({1.0, 1.0}, -2.0);
+    cache.insert({1.5, 1.0}, -2.5);
+    cache.flush();
+    {
+        likeligrid::LoglikCache reopened(dir, "abc", 2u);
+        if (reopened.size() != 4u) return 1;
+        if (!reopened.find({1.5, 1.0}, &loglik) || loglik != -2.5) return 1;
+    }
+    {
+        // records after garbage in the middle are found again,
+        // and a corrupted record is not loaded
+        std::ifstream ifs(path, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        const size_t header_size = 16u, record_size = 2u * 2u + 8u + 4u;
+        content[header_size + record_size + 5u] ^= 0x40;
+        content.insert(header_size + 2u * record_size, "xyz");
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        ofs << content;
+    }
+    likeligrid::LoglikCache resynced(dir, "abc", 2u);
+    if (resynced.size() != 3u) return 1;
+    if (resynced.find({2.0, 0.01}, &loglik)) return 1;
+    if (!resynced.find({1.0, 1.0}, &loglik) || loglik != -2.0) return 1;
+    if (!resynced.find({1.5, 1.0}, &loglik) || loglik != -2.5) return 1;
+
+    // records of another process are loaded on flush
+    likeligrid::LoglikCache other(dir, "abc", 2u);
+    other.insert({0.25, 0.25}, -7.0);
+    other.flush();
+    resynced.insert({0.75, 0.75}, -8.0);
+    resynced.flush();
+    if (!resynced.find({0.25, 0.25}, &loglik) || loglik != -7.0) return 1;
+    if (likeligrid::LoglikCache(dir, "abc", 2u).size() != 5u) return 1;
+    std::remove(path.c_str());
+    std::remove(dir.c_str());
+    return 0;
+}
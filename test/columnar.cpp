@@ -0,0 +1,161 @@
+#include "columnar.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <iterator>
+
+int check_roundtrip(const bool compress) {
+    const std::string path = compress ? "test-columnar-zlib.bin" : "test-columnar.bin";
+    std::remove(path.c_str());
+    const std::string header = "##max_sites=3\nloglik\tA\tB\n";
+    {
+        likeligrid::ColumnarWriter writer(path, header, 3u, compress);
+        for (size_t i=0u; i<5000u; ++i) {
+            writer.push_back(-1.0 * i, {0.01 * i, 2.0 - 0.01 * i});
+        }
+    }
+    {
+        // append to an existing file
+        likeligrid::ColumnarWriter writer(path, "", 3u);
+        writer.push_back(0.5, {1.0, 1.0});
+    }
+    {
+        // a truncated block at the end is ignored
+        std::ofstream ofs(path, std::ios::binary | std::ios::app);
+        ofs << "garbage";
+    }
+    likeligrid::ColumnarReader reader(path);
+    std::cerr << path << ": " << reader.num_rows() << " rows" << std::endl;
+    if (reader.header() != header) return 1;
+    if (reader.compressed() != compress) return 1;
+    if (reader.num_rows() != 5001u) return 1;
+    if (reader.colnames().at(2u) != "B") return 1;
+    if (reader.loglik(4321u) != -4321.0) return 1;
+    if (reader.params(4321u)[1u] != 2.0 - 0.01 * 4321u) return 1;
+    if (reader.column(1u)[5000u] != 1.0) return 1;
+    std::ostringstream oss;
+    likeligrid::write_tsv(reader, oss);
+    const std::string head = header + "-0\t0\t2\n-1\t0.01\t1.99\n";
+    if (oss.str().compare(0u, head.size(), head) != 0) return 1;
+    std::remove(path.c_str());
+    return 0;
+}
+
+int check_checkpoint(const bool compress) {
+    const std::string path = compress ? "test-checkpoint-zlib.bin" : "test-checkpoint.bin";
+    std::remove(path.c_str());
+    const std::string header = "loglik\tA\tB\n";
+    {
+        likeligrid::ColumnarWriter writer(path, header, 3u, compress);
+        for (size_t i=0u; i<10000u; ++i) {
+            // max at i=3000 and its tie at i=7000, which is closer to neutral
+            const double x = (i % 4000u == 3000u) ? 0.0 : -1.0 - 0.001 * i;
+            writer.push_back(x, {0.0001 * i, 1.0});
+        }
+    }
+    const likeligrid::ColumnarReader reader(path);
+    const auto checkpoint = likeligrid::read_checkpoint(path);
+    std::cerr << path << ": " << checkpoint.num_rows << " rows, "
+              << checkpoint.max_loglik << " at " << checkpoint.mle_params[0u] << std::endl;
+    if (checkpoint.header != header) return 1;
+    if (checkpoint.num_rows != 10000u) return 1;
+    if (checkpoint.valid_size != reader.valid_size()) return 1;
+    if (reader.checkpoint().num_rows != 10000u) return 1;
+    if (checkpoint.max_loglik != 0.0) return 1;
+    if (checkpoint.mle_params[0u] != 0.0001 * 7000u) return 1;
+    {
+        // tear the last block: the previous checkpoint is found from the tail
+        std::ifstream ifs(path, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        ofs.write(content.data(), static_cast<std::streamsize>(content.size() - 100u));
+    }
+    const auto torn = likeligrid::read_checkpoint(path);
+    if (torn.num_rows != 8192u) return 1;
+    if (torn.mle_params[0u] != 0.0001 * 7000u) return 1;
+    if (likeligrid::ColumnarReader(path).num_rows() != 8192u) return 1;
+    {
+        likeligrid::ColumnarWriter writer(path, "", 3u);
+        writer.push_back(1.0, {2.0, 2.0});
+    }
+    const auto resumed = likeligrid::read_checkpoint(path);
+    if (resumed.num_rows != 8193u) return 1;
+    if (resumed.max_loglik != 1.0) return 1;
+    if (likeligrid::ColumnarReader(path).loglik(8192u) != 1.0) return 1;
+    std::remove(path.c_str());
+    return 0;
+}
+
+// approximate rows next to the maximum are not candidates of MLE
+int check_approximate() {
+    const std::string path = "test-approximate.bin";
+    std::remove(path.c_str());
+    const std::string header = "loglik\tA\tapproximate\n";
+    std::ostringstream tsv;
+    tsv << header;
+    {
+        likeligrid::ColumnarWriter writer(path, header, 3u);
+        for (size_t i=0u; i<100u; ++i) {
+            const double approximate = (i == 50u || i % 10u == 0u) ? 0.0 : 1.0;
+            const double loglik = (i == 50u) ? -1.0 : (approximate > 0.0 ? -0.5 : -2.0);
+            writer.push_back(loglik, {0.01 * i, approximate});
+            tsv << loglik << "\t" << 0.01 * i << "\t" << approximate << "\n";
+        }
+    }
+    const auto checkpoint = likeligrid::read_checkpoint(path);
+    std::remove(path.c_str());
+    if (!checkpoint.approximate) return 1;
+    if (checkpoint.max_loglik != -1.0) return 1;
+    if (checkpoint.mle_params.size() != 1u || checkpoint.mle_params[0u] != 0.5) return 1;
+    std::istringstream iss(tsv.str());
+    size_t num_rows;
+    std::valarray<double> mle_params;
+    double max_loglik;
+    std::tie(num_rows, std::ignore, mle_params, max_loglik) = likeligrid::read_body(iss);
+    if (num_rows != 100u || max_loglik != -1.0) return 1;
+    if (mle_params.size() != 1u || mle_params[0u] != 0.5) return 1;
+    return 0;
+}
+
+// a file killed before or during the file header is written again
+int check_partial_header() {
+    const std::string path = "test-partial-header.bin";
+    std::remove(path.c_str());
+    const std::string header = "loglik\tA\tB\n";
+    std::string content;
+    {
+        likeligrid::ColumnarWriter writer(path, header, 3u);
+        // written before the first row
+        std::ifstream ifs(path, std::ios::binary);
+        content.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    }
+    if (content.size() <= header.size()) return 1;
+    for (const size_t size: {size_t(0u), size_t(3u), content.size() - 1u}) {
+        {
+            std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+            ofs.write(content.data(), static_cast<std::streamsize>(size));
+        }
+        if (likeligrid::read_checkpoint(path).valid_size != 0u) return 1;
+        {
+            likeligrid::ColumnarWriter writer(path, header, 3u);
+            writer.push_back(-1.0, {1.0, 1.0});
+        }
+        const auto checkpoint = likeligrid::read_checkpoint(path);
+        if (checkpoint.header != header || checkpoint.num_rows != 1u) return 1;
+    }
+    std::remove(path.c_str());
+    return 0;
+}
+
+int main() {
+    if (check_roundtrip(false)) return 1;
+    if (check_roundtrip(true)) return 1;
+    if (check_checkpoint(false)) return 1;
+    if (check_checkpoint(true)) return 1;
+    if (check_approximate()) return 1;
+    if (check_partial_header()) return 1;
+    return 0;
+}
@@ -2,6 +2,28 @@
 
 #include <iostream>
 #include <sstream>
+#include <cmath>
+#include <algorithm>
+
+//! Compare the analytic gradient with central differences of calc_loglik()
+bool check_gradient(const likeligrid::GenotypeModel& model, const std::valarray<double>& theta) {
+    std::valarray<double> gradient;
+    const double loglik = model.calc_loglik_and_gradient(theta, &gradient);
+    if (std::abs(loglik - model.calc_loglik(theta)) > 1e-9) return false;
+    if (gradient.size() != theta.size()) return false;
+    constexpr double h = 1e-6;
+    for (size_t k=0u; k<theta.size(); ++k) {
+        auto upper = theta, lower = theta;
+        upper[k] += h;
+        lower[k] -= h;
+        const double numeric = (model.calc_loglik(upper) - model.calc_loglik(lower)) / (2.0 * h);
+        std::cerr << model.names()[k] << ": " << gradient[k] << " " << numeric << std::endl;
+        // zero would leave the parameter untested
+        if (gradient[k] == 0.0) return false;
+        if (std::abs(gradient[k] - numeric) > 1e-6 * std::max(1.0, std::abs(numeric))) return false;
+    }
+    return true;
+}
 
 int main() {
     std::stringstream sst;
@@ -13,5 +35,62 @@ R"({
 })";
     likeligrid::GenotypeModel model(sst, 4u);
     std::cerr << model.calc_loglik({1.0, 1.0}) << std::endl;
+    const double loglik = model.calc_loglik({0.8, 1.3});
+    if (model.calc_loglik({0.8, 1.3}, 4u) != loglik) return 1;
+    const auto batch = model.calc_loglik_batch({{1.0, 1.0}, {0.8, 1.3}, {1.7, 0.2}}, 2u);
+    if (batch[1u] != loglik || batch[2u] != model.calc_loglik({1.7, 0.2})) return 1;
+    const auto approx = model.approx_loglik_batch({{0.8, 1.3}});
+    if (std::abs(approx[0u] - loglik) > 1e-3) return 1;
+    const auto axis = model.calc_axis({1.0, 1.3}, 0u, 0.01, 2.0);
+    for (const double x: {0.01, 0.8, 1.0, 2.0}) {
+        if (std::abs(axis(x) - model.calc_loglik({x, 1.3})) > 1e-9) return 1;
+    }
+    // the DP of a small dataset fits in memory
+    if (model.engine() != likeligrid::GenotypeModel::Engine::dp) return 1;
+    if (model.dp_bytes() > likeligrid::GenotypeModel::memory_limit()) return 1;
+    model.set_engine(likeligrid::GenotypeModel::Engine::recursion);
+    const double reference = model.calc_loglik({0.8, 1.3});
+    std::cerr << loglik << " " << reference << std::endl;
+    if (std::abs(loglik - reference) > 1e-9) return 1;
+    const auto reference_axis = model.calc_axis({1.0, 1.3}, 0u, 0.01, 2.0);
+    for (const double x: {0.01, 0.8, 2.0}) {
+        if (std::abs(reference_axis(x) - axis(x)) > 1e-9) return 1;
+    }
+
+    // genes in both A and B for pleiotropy
+    const std::string overlapping = R"({
+  "pathway": ["A", "B", "C"],
+  "annotation": ["011100", "110001", "000011"],
+  "sample": ["110000", "011000", "100100", "000110", "010001",
+             "101000", "000011", "110100", "001010", "100001"]
+})";
+    likeligrid::GenotypeModel plain(std::istringstream(overlapping), 3u);
+    if (!check_gradient(plain, {0.8, 1.3, 1.1})) return 1;
+    likeligrid::GenotypeModel epistasis(plain);
+    epistasis.set_epistasis({0u, 1u});
+    if (!check_gradient(epistasis, {0.8, 1.3, 1.1, 0.7})) return 1;
+    likeligrid::GenotypeModel pleiotropy(plain);
+    pleiotropy.set_epistasis({0u, 1u}, true);
+    if (!check_gradient(pleiotropy, {0.8, 1.3, 1.1, 0.7, 1.4})) return 1;
+
+    // skewed gene weights leave rare genes to be pruned
+    std::istringstream skewed(
+R"({
+  "pathway": ["A", "B"],
+  "annotation": ["000111", "111000"],
+  "sample": ["110000", "100000", "010000", "110000", "100100",
+             "100010", "010001", "110000", "100000", "001000"]
+})");
+    likeligrid::GenotypeModel recursion(skewed, 3u);
+    recursion.set_engine(likeligrid::GenotypeModel::Engine::recursion);
+    const double unpruned = recursion.calc_loglik({1.0, 1.0});
+    recursion.set_pruning(0.5);
+    double skipped = 0.0;
+    const double pruned = recursion.calc_loglik_and_skipped({1.0, 1.0}, &skipped);
+    std::cerr << pruned << " " << unpruned << " skipped " << skipped << std::endl;
+    // the bound accumulated over subtrees is within the tolerance;
+    // 6 samples have 2 mutations
+    if (skipped <= 0.0 || skipped > 0.5) return 1;
+    if (pruned < unpruned - 1e-9 || pruned > unpruned - 6.0 * std::log1p(-skipped) + 1e-9) return 1;
     return 0;
 }
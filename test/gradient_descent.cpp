@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <cmath>
 
 int main() {
     std::stringstream sst;
@@ -13,8 +14,24 @@ R"({
   "annotation": ["0011", "1100"],
   "sample": ["0011", "0101", "1001", "0110", "1010", "1100"]
 })";
+    const std::string data = sst.str();
     likeligrid::GradientDescent searcher(sst, 4, {0, 1}, false);
     searcher.run(std::cout);
-    std::cout << *searcher.const_max_iterator() << std::endl;
+    std::cout << searcher.max_point() << std::endl;
+
+    std::istringstream iss(data);
+    likeligrid::GradientDescent lbfgs(iss, 4, {0, 1}, false);
+    lbfgs.set_method(likeligrid::GradientDescent::Method::lbfgs);
+    lbfgs.run(std::cout);
+    std::cout << lbfgs.max_point() << std::endl;
+    // continuous optimum is at least as good as the lattice one
+    if (lbfgs.max_point().second < searcher.max_point().second - 1e-9) return 1;
+
+    std::istringstream iss_async(data);
+    likeligrid::GradientDescent async(iss_async, 4, {0, 1}, false, 4u);
+    async.set_asynchronous(true);
+    async.run(std::cout);
+    std::cout << async.max_point() << std::endl;
+    if (std::abs(async.max_point().second - searcher.max_point().second) > 1e-9) return 1;
     return 0;
 }
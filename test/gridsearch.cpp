@@ -1,6 +1,7 @@
 #include "gridsearch.hpp"
 
 #include <sstream>
+#include <cmath>
 
 int main() {
     std::stringstream sst;
@@ -10,7 +11,39 @@ R"({
   "annotation": ["0011", "1100"],
   "sample": ["0011", "0101", "1001", "0110", "1010", "1100"]
 })";
+    const std::string data = sst.str();
     likeligrid::GridSearch searcher(sst, 4u, {0, 1});
     searcher.run_cout();
+
+    // the coarsest stage reaches as high a cell with fewer evaluations;
+    // this surface is flat along the diagonal, so parameters may differ
+    likeligrid::GridSearch adaptive(std::istringstream(data), 4u, {0, 1});
+    adaptive.set_adaptive(true);
+    adaptive.run_cout();
+    likeligrid::GenotypeModel model(std::istringstream(data), 4u);
+    model.set_epistasis({0, 1});
+    const double full_max = model.calc_loglik(searcher.mle_params());
+    const double adaptive_max = model.calc_loglik(adaptive.mle_params());
+    if (std::abs(adaptive_max - full_max) > 1e-9) return 1;
+
+    // approximate rows around the maximum do not change the MLE
+    likeligrid::GridSearch prefiltered(std::istringstream(data), 4u, {0, 1});
+    prefiltered.set_prefilter(1e-6);
+    prefiltered.run_cout();
+    if ((prefiltered.mle_params() != searcher.mle_params()).max()) return 1;
+
+    // on a surface that is not flat, refinement finds the MLE of the full grid
+    const std::string skewed = R"({
+  "pathway": ["A", "B"],
+  "annotation": ["000111", "111000"],
+  "sample": ["110000", "100000", "010000", "110000", "100100",
+             "100010", "010001", "110000", "100000", "001000"]
+})";
+    likeligrid::GridSearch skewed_full(std::istringstream(skewed), 3u);
+    skewed_full.run_cout();
+    likeligrid::GridSearch skewed_adaptive(std::istringstream(skewed), 3u);
+    skewed_adaptive.set_adaptive(true);
+    skewed_adaptive.run_cout();
+    if ((std::abs(skewed_adaptive.mle_params() - skewed_full.mle_params()) > 1e-9).max()) return 1;
     return 0;
 }
@@ -0,0 +1,50 @@
+#include "lattice.hpp"
+
+#include <iostream>
+#include <random>
+#include <set>
+
+int main() {
+    likeligrid::LatticeTable table(3u);
+    int16_t key[3];
+    for (int16_t i=1; i<=200; ++i) {
+        key[0] = i; key[1] = static_cast<int16_t>(201 - i); key[2] = 100;
+        if (!table.emplace(key, -1.0 * i).second) return 1;
+    }
+    key[0] = 5; key[1] = 196; key[2] = 100;
+    if (table.emplace(key, 0.0).second) return 1;
+    const size_t row = table.find(key);
+    if (row != 4u || table.loglik(row) != -5.0) return 1;
+    if (table.params(row)[1u] != 1.96) return 1;
+    key[2] = 99;
+    if (table.find(key) != likeligrid::LatticeTable::npos) return 1;
+    if (table.size() != 200u) return 1;
+    if (likeligrid::encode_lattice({0.5, 1.255}, key)) return 1;
+    if (!likeligrid::encode_lattice({0.01, 2.0, 0.29}, key) || key[2] != 29) return 1;
+
+    // every neighbor exactly once, clipped at the boundary
+    std::mt19937_64 engine;
+    const int16_t center[4] = {1, 100, 200, 50};
+    likeligrid::LatticeNeighbors neighbors(center, 4u, 200, engine);
+    std::set<std::vector<int16_t>> visited;
+    int16_t neighbor[4];
+    while (neighbors.next(neighbor)) {
+        if (!visited.emplace(neighbor, neighbor + 4).second) return 1;
+        for (size_t j=0u; j<4u; ++j) {
+            if (neighbor[j] < 1 || neighbor[j] > 200) return 1;
+            if (std::abs(neighbor[j] - center[j]) > 1) return 1;
+        }
+    }
+    std::cerr << "neighbors: " << visited.size() << std::endl;
+    if (visited.size() != 2u * 3u * 2u * 3u - 1u) return 1;
+
+    // 3^k beyond 64 bits
+    const std::vector<int16_t> wide(100u, 100);
+    likeligrid::LatticeNeighbors wide_neighbors(wide.data(), wide.size(), 200, engine);
+    std::vector<int16_t> wide_key(wide.size());
+    for (size_t i=0u; i<1000u; ++i) {
+        if (!wide_neighbors.next(wide_key.data())) return 1;
+        if (!visited.emplace(wide_key).second) return 1;
+    }
+    return 0;
+}
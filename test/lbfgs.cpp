@@ -0,0 +1,23 @@
+#include "lbfgs.hpp"
+
+#include <iostream>
+#include <cmath>
+
+int main() {
+    // Rosenbrock function with the minimum (1, 1) outside the box
+    auto rosenbrock = [](const std::valarray<double>& x, std::valarray<double>* grad) {
+        const double a = 1.0 - x[0];
+        const double b = x[1] - x[0] * x[0];
+        (*grad)[0] = -2.0 * a - 400.0 * x[0] * b;
+        (*grad)[1] = 200.0 * b;
+        return a * a + 100.0 * b * b;
+    };
+    likeligrid::ProjectedLbfgs optimizer({-2.0, -2.0}, {0.5, 2.0});
+    std::valarray<double> x{-1.2, 1.0};
+    const double value = optimizer.minimize(rosenbrock, &x);
+    std::cerr << value << " " << x[0] << " " << x[1]
+              << " in " << optimizer.iterations() << " iterations" << std::endl;
+    if (std::abs(x[0] - 0.5) > 1e-6) return 1;
+    if (std::abs(x[1] - 0.25) > 1e-4) return 1;
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "logsumexp.hpp"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+int main() {
+    std::cerr << likeligrid::sum_exp_isa() << std::endl;
+    std::mt19937_64 engine(42u);
+    std::uniform_real_distribution<double> uniform(-750.0, 0.0);
+    std::vector<double> x(1001u);
+    for (auto& v: x) v = uniform(engine);
+    x[7u] = 0.0;
+    x[8u] = -1e-12;
+    x[9u] = -0.5 * std::log(2.0);
+    double expected = 0.0;
+    for (const double v: x) expected += std::exp(v);
+    const double sum = likeligrid::sum_exp(x.data(), x.size(), 0.0);
+    std::cerr << sum << " " << expected << std::endl;
+    if (std::abs(sum / expected - 1.0) > 1e-14) return 1;
+    for (size_t i=0u; i<x.size(); ++i) {
+        const double y = likeligrid::sum_exp(x.data() + i, 1u, 0.0);
+        if (std::abs(y - std::exp(x[i])) > 1e-14 * std::exp(x[i]) + 1e-300) return 1;
+    }
+
+    // the max changes in the middle of blocks
+    likeligrid::LogSumExp lse;
+    if (lse.result() != -std::numeric_limits<double>::infinity()) return 1;
+    double max = -std::numeric_limits<double>::infinity();
+    for (size_t i=0u; i<x.size(); ++i) {
+        x[i] += 0.3 * i;
+        max = std::max(max, x[i]);
+        lse.push(x[i]);
+    }
+    lse.push(-std::numeric_limits<double>::infinity());
+    expected = 0.0;
+    for (const double v: x) expected += std::exp(v - max);
+    expected = max + std::log(expected);
+    const double result = lse.result();
+    std::cerr << result << " " << expected << std::endl;
+    if (std::abs(result - expected) > 1e-12) return 1;
+    return 0;
+}
@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <sstream>
+#include <cmath>
+#include <algorithm>
 
 int main() {
     std::stringstream sst;
@@ -13,6 +15,34 @@ R"(A B
 0 2
 )";
     likeligrid::PathtypeModel model(std::move(sst), 3u);
-    std::cerr << model.calc_loglik({0.8, 1.2}) << std::endl;
+    const double loglik = model.calc_loglik({0.8, 1.2});
+    model.set_engine(likeligrid::PathtypeModel::Engine::bruteforce);
+    const double reference = model.calc_loglik({0.8, 1.2});
+    std::cerr << loglik << " " << reference << std::endl;
+    if (std::abs(loglik - reference) > 1e-9) return 1;
+
+    // the analytic gradient agrees with central differences
+    likeligrid::PathtypeModel wide(std::istringstream(
+R"(A B
+0 1
+1 0
+1 1
+0 2
+2 1
+1 2
+0 3
+)"), 3u);
+    std::valarray<double> gradient;
+    if (std::abs(wide.calc_loglik_and_gradient({0.8, 1.2}, &gradient) - wide.calc_loglik({0.8, 1.2})) > 1e-9) return 1;
+    constexpr double h = 1e-6;
+    for (size_t k=0u; k<2u; ++k) {
+        std::valarray<double> upper{0.8, 1.2}, lower{0.8, 1.2};
+        upper[k] += h;
+        lower[k] -= h;
+        const double numeric = (wide.calc_loglik(upper) - wide.calc_loglik(lower)) / (2.0 * h);
+        std::cerr << gradient[k] << " " << numeric << std::endl;
+        if (gradient[k] == 0.0) return 1;
+        if (std::abs(gradient[k] - numeric) > 1e-6 * std::max(1.0, std::abs(numeric))) return 1;
+    }
     return 0;
 }
@@ -0,0 +1,46 @@
+#include "queue.hpp"
+
+#include <wtl/filesystem.hpp>
+
+#include <iostream>
+
+int main() {
+    namespace fs = wtl::filesystem;
+    const std::string dir = (fs::temp_directory_path() / "likeligrid-test-queue").string();
+    fs::remove_all(dir);
+    likeligrid::WorkQueue coordinator(dir);
+    const std::vector<std::valarray<double>> axes{{0.5, 1.0, 1.5}, {0.25, 2.0}};
+    const std::string job = coordinator.post("abc", axes, 2u);
+    if (!coordinator.busy()) return 1;
+
+    likeligrid::WorkQueue worker(dir);
+    likeligrid::WorkQueue::Chunk chunk;
+    // chunks are claimable only after they are put
+    if (worker.claim_any("abc", &chunk)) return 1;
+    coordinator.put(job, 1u);
+    coordinator.put(job, 3u);
+    if (worker.claim_any("xyz", &chunk)) return 1;
+    if (!worker.claim_any("abc", &chunk)) return 1;
+    if (chunk.job != job || chunk.begin != 1u || chunk.end != 3u) return 1;
+    if (chunk.axes->size() != 2u || (*chunk.axes)[0u][2u] != 1.5) return 1;
+    std::vector<double> logliks;
+    if (coordinator.take(job, 1u, &logliks)) return 1;
+    worker.complete(job, 1u, {-1.5, -2.5});
+    if (!coordinator.take(job, 1u, &logliks)) return 1;
+    if (logliks != std::vector<double>({-1.5, -2.5})) return 1;
+
+    // a claim is returned to todo after the lease
+    if (!worker.claim_any("abc", &chunk) || chunk.begin != 3u) return 1;
+    if (coordinator.claim(job, 3u)) return 1;
+    likeligrid::WorkQueue(dir, -1.0).requeue();
+    if (!coordinator.claim(job, 3u)) return 1;
+    coordinator.complete(job, 3u, {-3.5, -4.5});
+    if (!coordinator.take(job, 3u, &logliks) || logliks[1u] != -4.5) return 1;
+    coordinator.put(job, 5u);
+    if (!worker.claim_any("abc", &chunk) || chunk.end != 6u) return 1;
+    coordinator.close(job);
+    if (coordinator.busy() || worker.claim_any("abc", &chunk)) return 1;
+    fs::remove_all(dir);
+    std::cerr << "ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include "samples.hpp"
+
+#include <iostream>
+#include <sstream>
+
+int main() {
+    const std::string json = R"({
+  "pathway": ["A", "B"],
+  "annotation": ["0011", "1100"],
+  "sample": ["0011", "0101", "1001", "0110", "0011", "1111"]
+})";
+    std::istringstream iss(json);
+    const auto samples = likeligrid::read_samples(iss, 2u);
+    if (samples.num_genes != 4u || samples.names.size() != 2u) return 1;
+    if (samples.nsam_with_s != std::vector<size_t>({0u, 0u, 5u, 0u, 1u})) return 1;
+    if (samples.genotypes.size() != 4u || samples.genotypes[0u].second != 2u) return 1;
+    if (samples.genotypes[0u].first != std::vector<size_t>({0u, 1u})) return 1;
+    if (samples.s_gene[0u] != 4.0 || samples.s_gene[3u] != 1.0) return 1;
+
+    // samples before the header
+    std::istringstream reordered(R"({"sample": ["0011", "0101", "1001", "0110", "0011", "1111"],
+      "extra": {"sample": [1, 2]},
+      "annotation": ["0011", "1100"], "pathway": ["A", "B"]})");
+    if (likeligrid::read_samples(reordered, 2u).digest != samples.digest) return 1;
+
+    std::istringstream json_iss(json);
+    std::stringstream packed;
+    likeligrid::pack_samples(json_iss, packed);
+    std::cerr << "packed: " << packed.str().size() << " bytes" << std::endl;
+    const auto unpacked = likeligrid::read_samples(packed, 2u);
+    if (unpacked.digest != samples.digest) return 1;
+    if (unpacked.annotation != samples.annotation) return 1;
+    if (unpacked.nsam_with_s != samples.nsam_with_s) return 1;
+    if (unpacked.genotypes != samples.genotypes) return 1;
+
+    std::istringstream invalid(R"({"pathway": ["A"], "annotation": ["01"], "sample": [11]})");
+    try {
+        likeligrid::read_samples(invalid, 2u);
+        return 1;
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return 0;
+}